@@ -1,25 +1,320 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <memory.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
-#include <zconf.h>
-#include <sys/errno.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
-const uint32_t PAGE_SIZE = 4096;
-const uint32_t TABLE_MAX_PAGES = 100;
+/*
+The page size is chosen when a database is created and stored in its
+header. PAGE_SIZE and the node layout values derived from it are set
+by set_page_size before the database file is opened.
+*/
+const uint32_t DEFAULT_PAGE_SIZE = 4096;
+const uint32_t MIN_PAGE_SIZE = 4096;
+const uint32_t MAX_PAGE_SIZE = 65536;
+uint32_t PAGE_SIZE;
+const uint32_t PAGER_DEFAULT_FRAMES = 100;
+/*
+Frames accessed within the last PAGER_PROTECTED_ACCESSES calls are
+never chosen as victims. This plays the role of LRU-K's correlated
+reference period. The count is for the whole pool, so each shard's
+clock uses its share of it. Pages in use are kept resident by pinning
+them.
+*/
+const uint32_t PAGER_PROTECTED_ACCESSES = 8;
+const uint32_t PAGER_MIN_FRAMES = 16;
+/*
+The pool is split into shards of at least PAGER_MIN_FRAMES frames
+each, up to PAGER_MAX_SHARDS, unless a number is asked for.
+*/
+const uint32_t PAGER_MAX_SHARDS = 16;
+/*
+On NUMA hosts the frames of every shard are split into one sub-pool
+per node, placed in that node's memory. A miss takes a frame from the
+sub-pool of the node the thread runs on when it can: an unused one, or
+else one of the first PAGER_LOCAL_VICTIM_SCAN frames next in line for
+eviction.
+*/
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 4096
+#ifndef NUMA_SYSFS_DIR
+#define NUMA_SYSFS_DIR "/sys/devices/system/node"
+#endif
+const uint32_t PAGER_LOCAL_VICTIM_SCAN = 8;
+/*
+Page replacement is 2Q. Pages enter a FIFO (A1in) on first use and
+are promoted to an LRU of hot pages (Am) only when they are used again
+outside the correlated reference period, either while still in A1in
+or after falling out of it, which is remembered in a ghost list of
+page numbers (A1out). Accesses made by scans never promote a page.
+*/
+const uint32_t TWO_Q_A1IN_PERCENT = 25;
+const uint32_t TWO_Q_A1OUT_PERCENT = 50;
+const uint32_t INVALID_FRAME_NUM = UINT32_MAX;
+const uint32_t INVALID_PAGE_NUM = UINT32_MAX;
+/*
+In mmap mode, address space for the whole file is reserved up front
+so the mapping can grow in place and page pointers never move.
+*/
+const size_t MMAP_RESERVE_SIZE = (size_t)1 << 44;
+const size_t MMAP_GROWTH_SIZE = 1 << 20;
+/*
+All frames live in one arena, aligned to and backed by huge pages
+where possible, so that touching many cached pages costs few TLB
+entries.
+*/
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+enum PagerMode_t {
+    PAGER_MODE_BUFFERED,  // pages are read into a pool of frames
+    PAGER_MODE_MMAP       // pages are accessed in place in a file mapping
+};
+typedef enum PagerMode_t PagerMode;
+
+enum PageAccess_t {
+    PAGE_ACCESS_NORMAL,
+    PAGE_ACCESS_SCAN  // part of a full scan; must not displace hot pages
+};
+typedef enum PageAccess_t PageAccess;
+
+enum FrameQueue_t { QUEUE_A1IN, QUEUE_AM };
+typedef enum FrameQueue_t FrameQueue;
+
+const uint32_t IO_RING_ENTRIES = 64;
+const uint32_t PAGER_DEFAULT_READAHEAD_PAGES = 16;
+// Consecutive misses needed before a scan is assumed to be sequential.
+const uint32_t READAHEAD_TRIGGER = 2;
+const uint32_t PAGER_DEFAULT_PREALLOC_MB = 1;
+const uint32_t PAGER_MAX_PREALLOC_MB = 64;
+/*
+The background writer wakes up every BG_WRITER_INTERVAL_MS, or sooner
+when the share of dirty frames goes over the target ratio, and writes
+back frames that have been dirty for too long and then the oldest ones
+until the ratio is met again.
+*/
+const uint32_t BG_WRITER_INTERVAL_MS = 100;
+const uint32_t BG_WRITER_BATCH_PAGES = 64;
+const uint32_t PAGER_DEFAULT_DIRTY_RATIO = 10;
+const uint32_t PAGER_DEFAULT_DIRTY_AGE_MS = 1000;
+/*
+With warm-up enabled, the pages in the pool are listed in a sidecar
+file next to the database on close, and loaded again in the background
+on open, a batch at a time so the foreground is never kept waiting for
+long.
+*/
+#define WARM_FILE_SUFFIX "-warm"
+const uint32_t WARMUP_BATCH_PAGES = 32;
+
+struct PagerConfig_t {
+    PagerMode mode;
+    uint32_t num_frames;
+    bool use_io_uring;
+    uint32_t readahead_pages;  // 0 disables readahead
+    uint32_t prealloc_mb;      // 0 disables preallocation
+    uint32_t page_size;        // used when creating a new database
+    bool warmup;               // save the cached pages on close, reload on open
+    uint32_t num_shards;       // 0 picks a number from the pool size
+    bool numa;                 // split the frames between the NUMA nodes
+    bool bg_writer;
+    uint32_t dirty_ratio;      // percent of frames the writer allows dirty
+    uint32_t dirty_age_ms;     // oldest a dirty frame may get
+};
+typedef struct PagerConfig_t PagerConfig;
+
+/*
+Minimal io_uring submission/completion rings, set up with the raw
+system calls so there is no dependency on liburing.
+*/
+struct IoRing_t {
+    int ring_fd;
+    uint32_t sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+typedef struct IoRing_t IoRing;
+
+/*
+One positioned read or write of one or more pages. Batches of these
+are handed to pager_run_io, which keeps them all in flight at once
+when io_uring is available.
+*/
+struct IoRequest_t {
+    bool write;
+    struct iovec* iov;
+    uint32_t iov_count;
+    off_t offset;
+    size_t length;
+};
+typedef struct IoRequest_t IoRequest;
+
+/*
+A frame is a slot in the buffer pool holding one cached page.
+Frames are linked into a hash chain (page table) and into the list
+of the replacement queue they belong to.
+*/
+struct Frame_t {
+    void* data;
+    uint32_t page_num;
+    bool dirty;  // modified since it was read or last written back
+    bool writing;  // a copy is being written back by the background writer
+    uint64_t dirtied_at;  // when it last went from clean to dirty, in ms
+    uint32_t pin_count;
+    FrameQueue queue;
+    uint64_t last_access;
+    uint64_t loaded_at;  // access clock when the page entered A1in
+    uint32_t hash_next;
+    uint32_t list_prev;  // towards the head (newest) of the queue
+    uint32_t list_next;  // towards the tail (next victim) of the queue
+};
+typedef struct Frame_t Frame;
+
+/*
+Counters for sizing the cache and finding where time goes, reported
+by the .stats command. Hits, misses and evictions are counted per
+shard and the rest for the whole pager.
+*/
+struct PagerStats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t pages_read;
+    uint64_t pages_written;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t fsyncs;
+    uint64_t io_time_ns;  // spent waiting for reads, writes and syncs
+    uint64_t remote_accesses;  // pins of a frame on another NUMA node than the thread
+};
+typedef struct PagerStats_t PagerStats;
+
+struct FrameList_t {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t size;
+};
+typedef struct FrameList_t FrameList;
+
+/*
+The buffer pool is split into shards, each owning an equal share of
+the frames with its own latch, page table and 2Q queues. A page
+always belongs to the same shard, so threads using different pages
+seldom wait for each other. A thread holds at most one shard latch,
+except when flushing, which takes them all in order, and may take the
+pager latch while holding one, but never the other way around.
+*/
+struct PagerShard_t {
+    pthread_mutex_t latch;
+    uint32_t first_frame;
+    uint32_t num_frames_used;
+    uint32_t* node_frames_used;  // per node sub-pool, frames handed out so far
+    uint32_t* page_table;  // bucket -> first frame in its hash chain
+    FrameList a1in;
+    FrameList am;
+    uint64_t access_clock;
+    uint32_t* ghost_pages;   // A1out as a ring of page numbers
+    uint32_t* ghost_next;    // hash chain through ghost slots
+    uint32_t* ghost_table;   // bucket -> first ghost slot
+    uint32_t ghost_oldest;   // slot overwritten by the next insert
+    uint32_t num_dirty;
+    uint32_t writes_in_flight;
+    pthread_cond_t writes_done;  // signalled when in-flight writes finish
+    PagerStats stats;
+};
+typedef struct PagerShard_t PagerShard;
 
 struct Pager_t {
+    PagerMode mode;
     int file_descriptor;
-    uint32_t  file_length;
+    uint64_t  file_length;
     uint32_t  num_pages;
-    void* pages[TABLE_MAX_PAGES];
+    uint64_t allocated_length;  // bytes of disk space reserved for the file
+    uint64_t prealloc_size;
+    char* map_base;
+    size_t map_reserved;
+    size_t map_length;
+    bool* map_dirty;  // per mapped page, modified since last msync
+    IoRing* io_ring;  // NULL when io_uring is disabled or unavailable
+    pthread_mutex_t ring_latch;  // one thread at a time submits to the ring
+    uint32_t num_frames;
+    Frame* frames;
+    char* frame_arena;  // frame i's page is at frame_arena + i * PAGE_SIZE
+    size_t frame_arena_size;
+    PagerShard* shards;
+    uint32_t num_shards;
+    uint32_t num_nodes;  // 1 when NUMA placement is off or not available
+    uint32_t node_ids[NUMA_MAX_NODES];
+    uint32_t* cpu_node;  // cpu -> index in node_ids, NULL with a single node
+    uint32_t num_cpus;
+    // Sizes below are per shard.
+    uint32_t frames_per_shard;
+    uint32_t frames_per_node;  // frames in each node's sub-pool
+    uint32_t page_table_mask;
+    uint32_t a1in_target;
+    uint32_t protected_accesses;  // PAGER_PROTECTED_ACCESSES as seen by one shard
+    uint32_t ghost_capacity;
+    uint32_t dirty_target;       // dirty frames the writer leaves alone
+    uint32_t readahead_pages;
+    uint32_t sequential_next;   // page a sequential scan would miss on next
+    uint32_t sequential_misses;
+    uint32_t readahead_end;     // first page past the last prefetched window
+    uint32_t freelist_head;     // first freelist trunk page, 0 if none
+    uint32_t freelist_count;
+    PagerStats stats;
+    /*
+    The pager latch guards the file length and page count, the I/O
+    counters, readahead state, the io_uring and, in mmap mode, the
+    mapping. Frames are guarded by the latch of their shard. Page
+    contents need no latch: the writer only copies unpinned frames.
+    */
+    pthread_mutex_t latch;
+    bool bg_writer;
+    pthread_t writer_thread;
+    pthread_cond_t writer_wake;
+    bool writer_stop;
+    uint64_t dirty_max_age_ms;
+    char* warm_path;  // sidecar listing cached pages, NULL without warm-up
+    pthread_t warmup_thread;
+    bool warmup_running;
+    bool warmup_stop;
 };
 typedef struct Pager_t Pager;
 
 struct Table_t {
     Pager* pager;
     uint32_t root_page_num;
+    uint64_t splits;  // nodes split since the database was opened
 };
 typedef struct Table_t Table;
 
@@ -27,7 +322,9 @@ struct Cursor_t {
     Table* table;
     uint32_t page_num;
     uint32_t cell_num;
+    void* node;         // the leaf at page_num, pinned while the cursor is open
     bool end_of_table;  // Indicates a position one past the last element
+    PageAccess access;  // PAGE_ACCESS_SCAN for cursors walking the whole table
 };
 typedef struct Cursor_t Cursor;
 
@@ -59,12 +356,15 @@ typedef struct InputBuffer_t InputBuffer;
 enum StatementType_t {
     STATEMENT_INSERT,
     STATEMENT_SELECT,
+    STATEMENT_SELECT_BY_ID,
+    STATEMENT_SELECT_RANGE,
+    STATEMENT_SELECT_DESCENDING,
 };
 
 typedef enum StatementType_t StatementType;
 
-const uint32_t COLUMN_USERNAME_SIZE = 32;
-const uint32_t COLUMN_EMAIL_SIZE = 255;
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
 struct Row_t {
     uint32_t id;
     // C strings are supposed to end with a null character.
@@ -76,6 +376,10 @@ typedef struct Row_t Row;
 struct Statement_t {
     StatementType type;
     Row row_to_insert; // only used by insert statement
+    uint32_t id_to_select; // only used by select by id
+    uint32_t min_id;       // only used by select between, inclusive
+    uint32_t max_id;
+    uint32_t limit;        // only used by select order by, UINT32_MAX if none
 };
 
 typedef struct Statement_t Statement;
@@ -126,8 +430,16 @@ const uint8_t COMMON_NODE_HEADER_SIZE =
  */
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE =
-        COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
+        LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_PREV_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_PREV_LEAF_OFFSET =
+        LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                       LEAF_NODE_NUM_CELLS_SIZE +
+                                       LEAF_NODE_NEXT_LEAF_SIZE +
+                                       LEAF_NODE_PREV_LEAF_SIZE;
 
 /*
  * Leaf Node Body Layout
@@ -138,13 +450,70 @@ const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET =
         LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
 const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS =
-        LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+// These depend on the page size; see set_page_size.
+uint32_t LEAF_NODE_SPACE_FOR_CELLS;
+uint32_t LEAF_NODE_MAX_CELLS;
+
+uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT;
+uint32_t LEAF_NODE_LEFT_SPLIT_COUNT;
+
+/*
+ * Database Header Layout
+ * Page 0 of the file holds the header; the tree lives on the others.
+ */
+const uint32_t DB_HEADER_PAGE_NUM = 0;
+/*
+Bumped on every change to the on-disk layout: 2 added the page
+checksum trailer, 3 moved internal node keys to their proper offset in
+the cell, 4 added the next-leaf pointer and 5 the previous-leaf pointer.
+*/
+const uint32_t DB_FORMAT_VERSION = 5;
+#define DB_HEADER_MAGIC "db_tutorial fmt"
+const uint32_t DB_HEADER_MAGIC_SIZE = sizeof(DB_HEADER_MAGIC);
+const uint32_t DB_HEADER_MAGIC_OFFSET = 0;
+const uint32_t DB_HEADER_VERSION_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_VERSION_OFFSET =
+        DB_HEADER_MAGIC_OFFSET + DB_HEADER_MAGIC_SIZE;
+const uint32_t DB_HEADER_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_PAGE_SIZE_OFFSET =
+        DB_HEADER_VERSION_OFFSET + DB_HEADER_VERSION_SIZE;
+const uint32_t DB_HEADER_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_ROOT_PAGE_OFFSET =
+        DB_HEADER_PAGE_SIZE_OFFSET + DB_HEADER_PAGE_SIZE_SIZE;
+const uint32_t DB_HEADER_NUM_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_NUM_PAGES_OFFSET =
+        DB_HEADER_ROOT_PAGE_OFFSET + DB_HEADER_ROOT_PAGE_SIZE;
+const uint32_t DB_HEADER_FREELIST_HEAD_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_FREELIST_HEAD_OFFSET =
+        DB_HEADER_NUM_PAGES_OFFSET + DB_HEADER_NUM_PAGES_SIZE;
+const uint32_t DB_HEADER_FREELIST_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_FREELIST_COUNT_OFFSET =
+        DB_HEADER_FREELIST_HEAD_OFFSET + DB_HEADER_FREELIST_HEAD_SIZE;
+#define DB_HEADER_SIZE 40  // bytes of page 0 used by the fields above
 
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-        (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+/*
+ * Freelist Trunk Page Layout
+ * Free pages are chained through trunk pages, each of which lists
+ * the page numbers of other free pages.
+ */
+const uint32_t FREELIST_TRUNK_NEXT_SIZE = sizeof(uint32_t);
+const uint32_t FREELIST_TRUNK_NEXT_OFFSET = 0;
+const uint32_t FREELIST_TRUNK_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t FREELIST_TRUNK_COUNT_OFFSET =
+        FREELIST_TRUNK_NEXT_OFFSET + FREELIST_TRUNK_NEXT_SIZE;
+const uint32_t FREELIST_TRUNK_HEADER_SIZE =
+        FREELIST_TRUNK_NEXT_SIZE + FREELIST_TRUNK_COUNT_SIZE;
+const uint32_t FREELIST_TRUNK_ENTRY_SIZE = sizeof(uint32_t);
+uint32_t FREELIST_TRUNK_MAX_ENTRIES;  // depends on the page size
+
+/*
+ * Page Trailer Layout
+ * The last bytes of every page, whatever its type, hold a CRC32C of
+ * the rest of the page. It is set when the page is written and checked
+ * when it is read. A page that is all zeros has never been written and
+ * is valid as it is.
+ */
+const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);
 
 /*
  * Internal Node Header Layout
@@ -165,6 +534,31 @@ const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE =
         INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+/*
+Key i is an upper bound for the keys under child i and lower than
+every key under child i + 1. The right child has no key.
+*/
+uint32_t INTERNAL_NODE_MAX_KEYS;  // depends on the page size
+
+bool page_size_is_valid(uint32_t page_size) {
+    return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE &&
+           (page_size & (page_size - 1)) == 0;
+}
+
+void set_page_size(uint32_t page_size) {
+    PAGE_SIZE = page_size;
+    LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - PAGE_CHECKSUM_SIZE - LEAF_NODE_HEADER_SIZE;
+    LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+    LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
+    LEAF_NODE_LEFT_SPLIT_COUNT =
+            (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+    INTERNAL_NODE_MAX_KEYS =
+            (PAGE_SIZE - PAGE_CHECKSUM_SIZE - INTERNAL_NODE_HEADER_SIZE) /
+            INTERNAL_NODE_CELL_SIZE;
+    FREELIST_TRUNK_MAX_ENTRIES =
+            (PAGE_SIZE - PAGE_CHECKSUM_SIZE - FREELIST_TRUNK_HEADER_SIZE) /
+            FREELIST_TRUNK_ENTRY_SIZE;
+}
 
 NodeType get_node_type(void* node) {
     uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
@@ -180,6 +574,16 @@ uint32_t* leaf_node_num_cells(void* node) {
     return (char *)node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
+// The leaf holding the next keys, 0 for the rightmost leaf.
+uint32_t* leaf_node_next_leaf(void* node) {
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+// The leaf holding the previous keys, 0 for the leftmost leaf.
+uint32_t* leaf_node_prev_leaf(void* node) {
+    return node + LEAF_NODE_PREV_LEAF_OFFSET;
+}
+
 void* leaf_node_cell(void* node, uint32_t cell_num) {
     return (char *)node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
 }
@@ -217,7 +621,7 @@ uint32_t* internal_node_child(void* node, uint32_t child_num) {
 }
 
 uint32_t* internal_node_key(void* node, uint32_t key_num) {
-    return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+    return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
 }
 
 uint32_t get_node_max_key(void* node) {
@@ -229,6 +633,46 @@ uint32_t get_node_max_key(void* node) {
     }
 }
 
+uint32_t* header_version(void* header) {
+    return header + DB_HEADER_VERSION_OFFSET;
+}
+
+uint32_t* header_page_size(void* header) {
+    return header + DB_HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t* header_root_page(void* header) {
+    return header + DB_HEADER_ROOT_PAGE_OFFSET;
+}
+
+uint32_t* header_num_pages(void* header) {
+    return header + DB_HEADER_NUM_PAGES_OFFSET;
+}
+
+uint32_t* header_freelist_head(void* header) {
+    return header + DB_HEADER_FREELIST_HEAD_OFFSET;
+}
+
+uint32_t* header_freelist_count(void* header) {
+    return header + DB_HEADER_FREELIST_COUNT_OFFSET;
+}
+
+uint32_t* node_parent(void* node) {
+    return node + PARENT_POINTER_OFFSET;
+}
+
+uint32_t* freelist_trunk_next(void* page) {
+    return page + FREELIST_TRUNK_NEXT_OFFSET;
+}
+
+uint32_t* freelist_trunk_count(void* page) {
+    return page + FREELIST_TRUNK_COUNT_OFFSET;
+}
+
+uint32_t* freelist_trunk_entry(void* page, uint32_t entry_num) {
+    return page + FREELIST_TRUNK_HEADER_SIZE + entry_num * FREELIST_TRUNK_ENTRY_SIZE;
+}
+
 bool is_node_root(void* node) {
     uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
     return (bool)value;
@@ -248,121 +692,1811 @@ void print_constants() {
     printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-    if (page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+uint32_t page_hash(uint32_t page_num) {
+    return page_num * 2654435761u;
+}
+
+// The shard comes from the high bits of the hash, the bucket from the low bits.
+PagerShard* pager_shard(Pager* pager, uint32_t page_num) {
+    return &pager->shards[((uint64_t)page_hash(page_num) * pager->num_shards) >> 32];
+}
+
+PagerShard* frame_shard(Pager* pager, Frame* frame) {
+    return &pager->shards[(frame - pager->frames) / pager->frames_per_shard];
+}
+
+uint32_t page_table_bucket(Pager* pager, uint32_t page_num) {
+    return page_hash(page_num) & pager->page_table_mask;
+}
+
+uint32_t page_table_lookup(Pager* pager, PagerShard* shard, uint32_t page_num) {
+    uint32_t frame_num = shard->page_table[page_table_bucket(pager, page_num)];
+    while (frame_num != INVALID_FRAME_NUM) {
+        if (pager->frames[frame_num].page_num == page_num) {
+            return frame_num;
+        }
+        frame_num = pager->frames[frame_num].hash_next;
+    }
+    return INVALID_FRAME_NUM;
+}
+
+void page_table_insert(Pager* pager, PagerShard* shard, uint32_t frame_num) {
+    Frame* frame = &pager->frames[frame_num];
+    uint32_t bucket = page_table_bucket(pager, frame->page_num);
+    frame->hash_next = shard->page_table[bucket];
+    shard->page_table[bucket] = frame_num;
+}
+
+void page_table_remove(Pager* pager, PagerShard* shard, uint32_t frame_num) {
+    Frame* frame = &pager->frames[frame_num];
+    uint32_t* link = &shard->page_table[page_table_bucket(pager, frame->page_num)];
+    while (*link != frame_num) {
+        link = &pager->frames[*link].hash_next;
+    }
+    *link = frame->hash_next;
+}
+
+void list_unlink(Pager* pager, FrameList* list, uint32_t frame_num) {
+    Frame* frame = &pager->frames[frame_num];
+    if (frame->list_prev != INVALID_FRAME_NUM) {
+        pager->frames[frame->list_prev].list_next = frame->list_next;
+    } else {
+        list->head = frame->list_next;
+    }
+    if (frame->list_next != INVALID_FRAME_NUM) {
+        pager->frames[frame->list_next].list_prev = frame->list_prev;
+    } else {
+        list->tail = frame->list_prev;
+    }
+    list->size--;
+}
+
+void list_push_front(Pager* pager, FrameList* list, uint32_t frame_num) {
+    Frame* frame = &pager->frames[frame_num];
+    frame->list_prev = INVALID_FRAME_NUM;
+    frame->list_next = list->head;
+    if (list->head != INVALID_FRAME_NUM) {
+        pager->frames[list->head].list_prev = frame_num;
+    } else {
+        list->tail = frame_num;
+    }
+    list->head = frame_num;
+    list->size++;
+}
+
+// Frames get their page once first claimed.
+bool frame_in_use(Frame* frame) {
+    return frame->data != NULL;
+}
+
+// Index in node_ids of the node whose sub-pool holds a frame.
+uint32_t frame_node(Pager* pager, uint32_t frame_num) {
+    return frame_num % pager->frames_per_shard / pager->frames_per_node;
+}
+
+FrameList* frame_queue_list(PagerShard* shard, Frame* frame) {
+    return frame->queue == QUEUE_AM ? &shard->am : &shard->a1in;
+}
+
+void frame_enqueue(Pager* pager, PagerShard* shard, uint32_t frame_num,
+                   FrameQueue queue) {
+    Frame* frame = &pager->frames[frame_num];
+    frame->queue = queue;
+    frame->last_access = ++shard->access_clock;
+    if (queue == QUEUE_A1IN) {
+        frame->loaded_at = frame->last_access;
+    }
+    list_push_front(pager, frame_queue_list(shard, frame), frame_num);
+}
+
+uint32_t ghost_bucket(Pager* pager, uint32_t page_num) {
+    return page_table_bucket(pager, page_num);
+}
+
+void ghost_unlink(Pager* pager, PagerShard* shard, uint32_t slot) {
+    uint32_t* link = &shard->ghost_table[ghost_bucket(pager, shard->ghost_pages[slot])];
+    while (*link != slot) {
+        link = &shard->ghost_next[*link];
+    }
+    *link = shard->ghost_next[slot];
+    shard->ghost_pages[slot] = INVALID_PAGE_NUM;
+}
+
+/*
+Remember a page evicted from A1in, forgetting the oldest ghost.
+*/
+void ghost_insert(Pager* pager, PagerShard* shard, uint32_t page_num) {
+    if (pager->ghost_capacity == 0) {
+        return;
+    }
+    uint32_t slot = shard->ghost_oldest;
+    if (shard->ghost_pages[slot] != INVALID_PAGE_NUM) {
+        ghost_unlink(pager, shard, slot);
+    }
+    uint32_t bucket = ghost_bucket(pager, page_num);
+    shard->ghost_pages[slot] = page_num;
+    shard->ghost_next[slot] = shard->ghost_table[bucket];
+    shard->ghost_table[bucket] = slot;
+    shard->ghost_oldest = (slot + 1) % pager->ghost_capacity;
+}
+
+/*
+Returns true if the page was in A1out, removing it from there.
+*/
+bool ghost_remove(Pager* pager, PagerShard* shard, uint32_t page_num) {
+    if (pager->ghost_capacity == 0) {
+        return false;
+    }
+    uint32_t slot = shard->ghost_table[ghost_bucket(pager, page_num)];
+    while (slot != INVALID_FRAME_NUM) {
+        if (shard->ghost_pages[slot] == page_num) {
+            ghost_unlink(pager, shard, slot);
+            return true;
+        }
+        slot = shard->ghost_next[slot];
+    }
+    return false;
+}
+
+/*
+Returns false if the kernel does not support io_uring, in which case
+the pager falls back to synchronous pread/pwrite.
+*/
+bool io_ring_init(IoRing* ring, uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return false;
+    }
+
+    ring->ring_fd = fd;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    if (ring->cq_ring_size == 0) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(fd);
+            return false;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring_size != 0) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        close(fd);
+        return false;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void io_ring_close(IoRing* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size != 0) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
     }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+}
 
-    if (pager->pages[page_num] == NULL) {
-        // Cache miss. Allocate memory and load from file.
-        void* page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
+int io_ring_enter(IoRing* ring, uint32_t to_submit, uint32_t min_complete) {
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit,
+                         min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (result == -1 && errno == EINTR);
+    return result;
+}
 
-        // We might save a partial page at the end of the file
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
+/*
+Submit the requests in batches of up to a ring's worth and wait for
+every one of them to complete.
+*/
+void io_ring_run(IoRing* ring, int fd, IoRequest* requests, uint32_t count) {
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t batch = count - done;
+        if (batch > ring->sq_entries) {
+            batch = ring->sq_entries;
         }
 
-        if (page_num <= num_pages) {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                printf("Error reading file: %d\n", errno);
+        unsigned tail = *ring->sq_tail;
+        for (uint32_t i = 0; i < batch; i++) {
+            IoRequest* request = &requests[done + i];
+            unsigned index = tail & *ring->sq_mask;
+            struct io_uring_sqe* sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t)request->iov;
+            sqe->len = request->iov_count;
+            sqe->off = request->offset;
+            sqe->user_data = done + i;
+            ring->sq_array[index] = index;
+            tail++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        uint32_t submitted = 0;
+        uint32_t completed = 0;
+        while (completed < batch) {
+            int result = io_ring_enter(ring, batch - submitted, 1);
+            if (result == -1) {
+                printf("Error submitting I/O: %d\n", errno);
                 exit(EXIT_FAILURE);
             }
+            submitted += result;
+
+            unsigned head = *ring->cq_head;
+            while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+                IoRequest* request = &requests[cqe->user_data];
+                if (cqe->res < 0 || (size_t)cqe->res != request->length) {
+                    printf("Error %s: %d\n", request->write ? "writing" : "reading",
+                           cqe->res < 0 ? -cqe->res : EIO);
+                    exit(EXIT_FAILURE);
+                }
+                head++;
+                completed++;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
         }
+        done += batch;
+    }
+}
 
-        pager->pages[page_num] = page;
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
+void io_run_blocking(int fd, IoRequest* requests, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        IoRequest* request = &requests[i];
+        ssize_t bytes;
+        if (request->write) {
+            bytes = pwritev(fd, request->iov, request->iov_count, request->offset);
+        } else {
+            bytes = preadv(fd, request->iov, request->iov_count, request->offset);
+        }
+        if (bytes == -1 || (size_t)bytes != request->length) {
+            printf("Error %s: %d\n", request->write ? "writing" : "reading", errno);
+            exit(EXIT_FAILURE);
         }
     }
-    return pager->pages[page_num];
 }
 
-void indent(uint32_t level) {
-    for (uint32_t i = 0; i < level; i++) {
-        printf("  ");
+void pager_note_io_time(Pager* pager, uint64_t io_time_ns) {
+    pthread_mutex_lock(&pager->latch);
+    pager->stats.io_time_ns += io_time_ns;
+    pthread_mutex_unlock(&pager->latch);
+}
+
+/*
+Perform a batch of page reads and writes, concurrently through
+io_uring when it is available and one at a time otherwise.
+*/
+void pager_run_io(Pager* pager, IoRequest* requests, uint32_t count) {
+    uint64_t start = monotonic_ns();
+    if (pager->io_ring != NULL) {
+        pthread_mutex_lock(&pager->ring_latch);
+        io_ring_run(pager->io_ring, pager->file_descriptor, requests, count);
+        pthread_mutex_unlock(&pager->ring_latch);
+    } else {
+        io_run_blocking(pager->file_descriptor, requests, count);
     }
+    pager_note_io_time(pager, monotonic_ns() - start);
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-    void* node = get_page(pager, page_num);
-    uint32_t num_keys, child;
+/*
+Page numbers are 32 bits, which addresses 16 TB of 4 KB pages, but
+byte offsets within the file must be computed in 64 bits.
+*/
+off_t page_offset(uint32_t page_num) {
+    return (off_t)page_num * PAGE_SIZE;
+}
 
-    switch (get_node_type(node)) {
-        case (NODE_LEAF):
-            num_keys = *leaf_node_num_cells(node);
-            indent(indentation_level);
-            printf("- leaf (size %d)\n", num_keys);
-            for (uint32_t i = 0; i < num_keys; i++) {
-                indent(indentation_level + 1);
-                printf("- %d\n", *leaf_node_key(node, i));
-            }
-            break;
-        case (NODE_INTERNAL):
-            num_keys = *internal_node_num_keys(node);
-            indent(indentation_level);
-            printf("- internal (size %d)\n", num_keys);
-            for (uint32_t i = 0; i < num_keys; i++) {
-                child = *internal_node_child(node, i);
-                print_tree(pager, child, indentation_level + 1);
+/*
+CRC32C (Castagnoli), computed with the CPU's CRC instructions where
+there are some and with a lookup table otherwise. crc32c_init picks
+the implementation once, before the first page is read or written.
+*/
+const uint32_t CRC32C_POLY = 0x82f63b78;  // reflected
+uint32_t crc32c_table[256];
+uint32_t (*crc32c_update)(uint32_t crc, const uint8_t* data, size_t length);
 
-                indent(indentation_level);
-                printf("- key %d\n", *internal_node_key(node, i));
-            }
-            child = *internal_node_right_child(node);
-            print_tree(pager, child, indentation_level + 1);
-            break;
+uint32_t crc32c_update_table(uint32_t crc, const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
     }
+    return crc;
 }
 
-void initialize_leaf_node(void* node) {
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_hw(uint32_t crc, const uint8_t* data, size_t length) {
+    uint64_t crc64 = crc;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; i < length; i++) {
+        crc = _mm_crc32_u8(crc, data[i]);
+    }
+    return crc;
 }
 
-void initialize_internal_node(void* node) {
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
+bool crc32c_hw_available() {
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+uint32_t crc32c_update_hw(uint32_t crc, const uint8_t* data, size_t length) {
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; i < length; i++) {
+        crc = __crc32cb(crc, data[i]);
+    }
+    return crc;
+}
+
+bool crc32c_hw_available() {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#else
+uint32_t crc32c_update_hw(uint32_t crc, const uint8_t* data, size_t length) {
+    return crc32c_update_table(crc, data, length);
+}
+
+bool crc32c_hw_available() {
+    return false;
+}
+#endif
+
+void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        crc32c_table[i] = crc;
+    }
+    crc32c_update = crc32c_hw_available() ? crc32c_update_hw : crc32c_update_table;
+}
+
+uint32_t* page_checksum(void* page) {
+    return page + PAGE_SIZE - PAGE_CHECKSUM_SIZE;
+}
+
+uint32_t page_compute_checksum(void* page) {
+    return ~crc32c_update(~0u, page, PAGE_SIZE - PAGE_CHECKSUM_SIZE);
+}
+
+// Called on every page just before it is written to the file.
+void page_set_checksum(void* page) {
+    *page_checksum(page) = page_compute_checksum(page);
+}
+
+bool page_is_zero(void* page) {
+    uint64_t* words = page;
+    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Called on every page read from the file.
+void page_verify_checksum(void* page, uint32_t page_num) {
+    if (*page_checksum(page) != page_compute_checksum(page) && !page_is_zero(page)) {
+        printf("Page %d is corrupt: checksum mismatch.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+}
+
+uint64_t monotonic_ms() {
+    return monotonic_ns() / 1000000;
+}
+
+/*
+Account for pages written back. Writes past the end of the file grow
+it, and pages there must be read back rather than zero filled if they
+are evicted and used again.
+*/
+void pager_note_write(Pager* pager, off_t offset, size_t length) {
+    pthread_mutex_lock(&pager->latch);
+    pager->stats.pages_written += length / PAGE_SIZE;
+    pager->stats.bytes_written += length;
+    if ((uint64_t)offset + length > pager->file_length) {
+        pager->file_length = offset + length;
+    }
+    pthread_mutex_unlock(&pager->latch);
+}
+
+void pager_note_read(Pager* pager, uint32_t num_pages, size_t length) {
+    pthread_mutex_lock(&pager->latch);
+    pager->stats.pages_read += num_pages;
+    pager->stats.bytes_read += length;
+    pthread_mutex_unlock(&pager->latch);
+}
+
+// The caller holds the latch of the frame's shard.
+void frame_mark_clean(Pager* pager, Frame* frame) {
+    if (frame->dirty) {
+        frame->dirty = false;
+        frame_shard(pager, frame)->num_dirty--;
+    }
+}
+
+void pager_write_frame(Pager* pager, Frame* frame) {
+    page_set_checksum(frame->data);
+    uint64_t start = monotonic_ns();
+    ssize_t bytes_written = pwrite(pager->file_descriptor, frame->data,
+                                   PAGE_SIZE, page_offset(frame->page_num));
+    pager_note_io_time(pager, monotonic_ns() - start);
+
+    if (bytes_written == -1) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager_note_write(pager, page_offset(frame->page_num), bytes_written);
+    frame_mark_clean(pager, frame);
+}
+
+int compare_frame_page_num(const void* a, const void* b) {
+    uint32_t page_a = (*(Frame**)a)->page_num;
+    uint32_t page_b = (*(Frame**)b)->page_num;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+void mmap_sync_run(Pager* pager, uint32_t first_page, uint32_t run_length) {
+    for (uint32_t i = first_page; i < first_page + run_length; i++) {
+        page_set_checksum(pager->map_base + page_offset(i));
+    }
+    uint64_t start = monotonic_ns();
+    int result = msync(pager->map_base + page_offset(first_page),
+                       (size_t)run_length * PAGE_SIZE, MS_SYNC);
+    if (result == -1) {
+        printf("Error syncing mapping: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager_note_io_time(pager, monotonic_ns() - start);
+    pager->stats.fsyncs++;
+    pager_note_write(pager, page_offset(first_page), (size_t)run_length * PAGE_SIZE);
+    for (uint32_t i = first_page; i < first_page + run_length; i++) {
+        pager->map_dirty[i] = false;
+    }
+}
+
+void mmap_flush_all(Pager* pager) {
+    pthread_mutex_lock(&pager->latch);
+    uint32_t mapped_pages = pager->map_length / PAGE_SIZE;
+    uint32_t i = 0;
+    while (i < mapped_pages) {
+        if (!pager->map_dirty[i]) {
+            i++;
+            continue;
+        }
+        uint32_t run_start = i;
+        while (i < mapped_pages && pager->map_dirty[i]) {
+            i++;
+        }
+        mmap_sync_run(pager, run_start, i - run_start);
+    }
+    pthread_mutex_unlock(&pager->latch);
+}
+
+/*
+Write back every dirty frame. Dirty pages are sorted by page number
+so that adjacent pages can be coalesced into one vectored write per
+run, and all runs are submitted together.
+*/
+void pager_flush_all(Pager* pager) {
+    if (pager->mode == PAGER_MODE_MMAP) {
+        mmap_flush_all(pager);
+        return;
+    }
+
+    // Adjacent pages are in different shards, so take every shard.
+    Frame** dirty = malloc(sizeof(Frame*) * pager->num_frames);
+    uint32_t num_dirty = 0;
+    for (uint32_t s = 0; s < pager->num_shards; s++) {
+        PagerShard* shard = &pager->shards[s];
+        pthread_mutex_lock(&shard->latch);
+        // An older copy still being written must not land after this one.
+        while (shard->writes_in_flight > 0) {
+            pthread_cond_wait(&shard->writes_done, &shard->latch);
+        }
+        for (uint32_t i = 0; i < pager->frames_per_shard; i++) {
+            Frame* frame = &pager->frames[shard->first_frame + i];
+            if (frame_in_use(frame) && frame->dirty) {
+                dirty[num_dirty++] = frame;
+            }
+        }
+    }
+    qsort(dirty, num_dirty, sizeof(Frame*), compare_frame_page_num);
+
+    struct iovec* iov = malloc(sizeof(struct iovec) * num_dirty);
+    IoRequest* requests = malloc(sizeof(IoRequest) * num_dirty);
+    uint32_t num_requests = 0;
+    uint32_t run_start = 0;
+    for (uint32_t i = 0; i < num_dirty; i++) {
+        page_set_checksum(dirty[i]->data);
+        iov[i].iov_base = dirty[i]->data;
+        iov[i].iov_len = PAGE_SIZE;
+
+        bool run_ends = i + 1 == num_dirty ||
+                        dirty[i + 1]->page_num != dirty[i]->page_num + 1 ||
+                        i + 1 - run_start == IOV_MAX;
+        if (run_ends) {
+            IoRequest* request = &requests[num_requests++];
+            request->write = true;
+            request->iov = &iov[run_start];
+            request->iov_count = i + 1 - run_start;
+            request->offset = page_offset(dirty[run_start]->page_num);
+            request->length = request->iov_count * PAGE_SIZE;
+            run_start = i + 1;
+        }
+    }
+    pager_run_io(pager, requests, num_requests);
+
+    for (uint32_t i = 0; i < num_requests; i++) {
+        pager_note_write(pager, requests[i].offset, requests[i].length);
+    }
+    for (uint32_t i = 0; i < num_dirty; i++) {
+        frame_mark_clean(pager, dirty[i]);
+    }
+    for (uint32_t s = pager->num_shards; s > 0; s--) {
+        pthread_mutex_unlock(&pager->shards[s - 1].latch);
+    }
+    free(requests);
+    free(iov);
+    free(dirty);
+}
+
+int compare_frame_dirtied_at(const void* a, const void* b) {
+    uint64_t age_a = (*(Frame**)a)->dirtied_at;
+    uint64_t age_b = (*(Frame**)b)->dirtied_at;
+    return (age_a > age_b) - (age_a < age_b);
+}
+
+/*
+Choose what the background writer writes next from a shard: every
+frame that has been dirty for longer than the age limit, then the
+oldest dirty frames until no more than dirty_target remain. Pinned
+frames may be in the middle of a change and are left for a later round.
+*/
+uint32_t bg_writer_select(Pager* pager, PagerShard* shard, Frame** batch) {
+    Frame** candidates = malloc(sizeof(Frame*) * pager->frames_per_shard);
+    uint32_t num_candidates = 0;
+    for (uint32_t i = 0; i < pager->frames_per_shard; i++) {
+        Frame* frame = &pager->frames[shard->first_frame + i];
+        if (frame_in_use(frame) && frame->dirty && !frame->writing &&
+            frame->pin_count == 0) {
+            candidates[num_candidates++] = frame;
+        }
+    }
+    qsort(candidates, num_candidates, sizeof(Frame*), compare_frame_dirtied_at);
+
+    uint64_t now = monotonic_ms();
+    uint32_t excess = 0;
+    if (shard->num_dirty > pager->dirty_target) {
+        excess = shard->num_dirty - pager->dirty_target;
+    }
+    uint32_t count = 0;
+    while (count < num_candidates && count < BG_WRITER_BATCH_PAGES &&
+           (count < excess ||
+            now - candidates[count]->dirtied_at >= pager->dirty_max_age_ms)) {
+        batch[count] = candidates[count];
+        count++;
+    }
+    free(candidates);
+    return count;
+}
+
+/*
+Write back one batch from a shard. The pages picked are copied while
+holding the shard latch, then written and synced with it released so
+the foreground can keep working. Frames stay marked as being written
+until then, which keeps them from being evicted and re-read before
+their new contents are on disk. Returns the number of pages written.
+*/
+uint32_t bg_writer_write_shard(Pager* pager, PagerShard* shard, char* buffer) {
+    Frame* batch[BG_WRITER_BATCH_PAGES];
+    struct iovec iov[BG_WRITER_BATCH_PAGES];
+    IoRequest requests[BG_WRITER_BATCH_PAGES];
+
+    pthread_mutex_lock(&shard->latch);
+    uint32_t count = bg_writer_select(pager, shard, batch);
+    if (count == 0) {
+        pthread_mutex_unlock(&shard->latch);
+        return 0;
+    }
+
+    qsort(batch, count, sizeof(Frame*), compare_frame_page_num);
+    uint32_t num_requests = 0;
+    uint32_t run_start = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(buffer + (size_t)i * PAGE_SIZE, batch[i]->data, PAGE_SIZE);
+        batch[i]->writing = true;
+        frame_mark_clean(pager, batch[i]);
+        iov[i].iov_base = buffer + (size_t)i * PAGE_SIZE;
+        iov[i].iov_len = PAGE_SIZE;
+
+        if (i + 1 == count || batch[i + 1]->page_num != batch[i]->page_num + 1) {
+            IoRequest* request = &requests[num_requests++];
+            request->write = true;
+            request->iov = &iov[run_start];
+            request->iov_count = i + 1 - run_start;
+            request->offset = page_offset(batch[run_start]->page_num);
+            request->length = request->iov_count * PAGE_SIZE;
+            run_start = i + 1;
+        }
+    }
+    shard->writes_in_flight++;
+    pthread_mutex_unlock(&shard->latch);
+
+    for (uint32_t i = 0; i < count; i++) {
+        page_set_checksum(buffer + (size_t)i * PAGE_SIZE);
+    }
+    // Plain syscalls keep the writer off the foreground's ring.
+    uint64_t start = monotonic_ns();
+    io_run_blocking(pager->file_descriptor, requests, num_requests);
+    if (fdatasync(pager->file_descriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager_note_io_time(pager, monotonic_ns() - start);
+    for (uint32_t i = 0; i < num_requests; i++) {
+        pager_note_write(pager, requests[i].offset, requests[i].length);
+    }
+    pthread_mutex_lock(&pager->latch);
+    pager->stats.fsyncs++;
+    pthread_mutex_unlock(&pager->latch);
+
+    pthread_mutex_lock(&shard->latch);
+    for (uint32_t i = 0; i < count; i++) {
+        batch[i]->writing = false;
+    }
+    shard->writes_in_flight--;
+    pthread_cond_broadcast(&shard->writes_done);
+    pthread_mutex_unlock(&shard->latch);
+    return count;
+}
+
+void* bg_writer_main(void* arg) {
+    Pager* pager = arg;
+    char* buffer = malloc((size_t)BG_WRITER_BATCH_PAGES * PAGE_SIZE);
+
+    pthread_mutex_lock(&pager->latch);
+    while (!pager->writer_stop) {
+        pthread_mutex_unlock(&pager->latch);
+        uint32_t written = 0;
+        for (uint32_t i = 0; i < pager->num_shards; i++) {
+            written += bg_writer_write_shard(pager, &pager->shards[i], buffer);
+        }
+        pthread_mutex_lock(&pager->latch);
+
+        if (written == 0 && !pager->writer_stop) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += (long)BG_WRITER_INTERVAL_MS * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&pager->writer_wake, &pager->latch, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&pager->latch);
+    free(buffer);
+    return NULL;
+}
+
+bool frame_is_protected(Pager* pager, PagerShard* shard, Frame* frame) {
+    return shard->access_clock - frame->last_access < pager->protected_accesses;
+}
+
+/*
+A hit on a page still in A1in is only a sign that it is hot once the
+correlated reference period since it was loaded is over; until then it
+is the same use, such as a lookup pinning a leaf twice.
+*/
+bool frame_is_correlated(Pager* pager, PagerShard* shard, Frame* frame) {
+    return shard->access_clock - frame->loaded_at < pager->protected_accesses;
+}
+
+bool frame_is_evictable(Pager* pager, PagerShard* shard, Frame* frame, bool protect) {
+    return frame->pin_count == 0 && !frame->writing &&
+           !(protect && frame_is_protected(pager, shard, frame));
+}
+
+/*
+Take the frame at the tail of a queue, rotating pinned and, if
+protect is set, recently accessed frames back to the head. Returns
+INVALID_FRAME_NUM if no frame in the queue can be evicted.
+*/
+uint32_t pager_find_victim(Pager* pager, PagerShard* shard, FrameList* list,
+                           bool protect) {
+    uint32_t size = list->size;
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t frame_num = list->tail;
+        if (frame_is_evictable(pager, shard, &pager->frames[frame_num], protect)) {
+            return frame_num;
+        }
+        list_unlink(pager, list, frame_num);
+        list_push_front(pager, list, frame_num);
+    }
+    return INVALID_FRAME_NUM;
+}
+
+/*
+Look at the first few evictable frames from the victim towards the
+head of its queue for one in the given node's sub-pool. Looking any
+further would evict pages much younger than the victim.
+*/
+uint32_t pager_local_victim(Pager* pager, PagerShard* shard, uint32_t victim,
+                            uint32_t node) {
+    uint32_t frame_num = victim;
+    for (uint32_t i = 0; i < PAGER_LOCAL_VICTIM_SCAN && frame_num != INVALID_FRAME_NUM;
+         i++) {
+        Frame* frame = &pager->frames[frame_num];
+        if (frame_node(pager, frame_num) == node &&
+            frame_is_evictable(pager, shard, frame, true)) {
+            return frame_num;
+        }
+        frame_num = frame->list_prev;
+    }
+    return victim;
+}
+
+/*
+Victims come from A1in while it is above its target size, and from Am
+otherwise. Recently accessed frames are only taken when nothing else
+is left, which with many threads sharing a small shard can happen.
+*/
+uint32_t pager_choose_victim(Pager* pager, PagerShard* shard, uint32_t node,
+                             bool prefetch) {
+    bool from_a1in = shard->a1in.size > pager->a1in_target || shard->am.size == 0;
+    FrameList* first = from_a1in ? &shard->a1in : &shard->am;
+    FrameList* second = from_a1in ? &shard->am : &shard->a1in;
+    uint32_t victim = pager_find_victim(pager, shard, first, true);
+    if (victim == INVALID_FRAME_NUM) {
+        victim = pager_find_victim(pager, shard, second, true);
+    }
+    if (victim == INVALID_FRAME_NUM && !prefetch) {
+        victim = pager_find_victim(pager, shard, first, false);
+        if (victim == INVALID_FRAME_NUM) {
+            victim = pager_find_victim(pager, shard, second, false);
+        }
+    }
+    if (victim != INVALID_FRAME_NUM && pager->num_nodes > 1) {
+        victim = pager_local_victim(pager, shard, victim, node);
+    }
+    return victim;
+}
+
+/*
+Return a frame of the shard that can hold a new page, preferably from
+the sub-pool of the given node. While the shard is not yet full this
+is an unused frame. Otherwise a victim is evicted, written back first
+if dirty, and its frame reused. Prefetches never wait and never take
+recently used frames; INVALID_FRAME_NUM is returned instead.
+*/
+uint32_t pager_claim_frame(Pager* pager, PagerShard* shard, uint32_t node,
+                           bool prefetch) {
+    if (shard->num_frames_used < pager->frames_per_shard) {
+        // Once the local sub-pool is used up, fill the others before evicting.
+        while (shard->node_frames_used[node] == pager->frames_per_node) {
+            node = (node + 1) % pager->num_nodes;
+        }
+        uint32_t frame_num = shard->first_frame + node * pager->frames_per_node +
+                             shard->node_frames_used[node]++;
+        shard->num_frames_used++;
+        pager->frames[frame_num].data =
+            pager->frame_arena + (size_t)frame_num * PAGE_SIZE;
+        pager->frames[frame_num].writing = false;
+        return frame_num;
+    }
+
+    uint32_t victim = pager_choose_victim(pager, shard, node, prefetch);
+    if (victim == INVALID_FRAME_NUM && prefetch) {
+        return INVALID_FRAME_NUM;
+    }
+    while (victim == INVALID_FRAME_NUM && shard->writes_in_flight > 0) {
+        // Frames being written by the background writer free up soon.
+        pthread_cond_wait(&shard->writes_done, &shard->latch);
+        victim = pager_choose_victim(pager, shard, node, prefetch);
+    }
+    if (victim == INVALID_FRAME_NUM) {
+        printf("No frame available for eviction: all frames are pinned.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    shard->stats.evictions++;
+    Frame* frame = &pager->frames[victim];
+    if (frame->dirty) {
+        pager_write_frame(pager, frame);
+    }
+    if (frame->queue == QUEUE_A1IN) {
+        ghost_insert(pager, shard, frame->page_num);
+    }
+    page_table_remove(pager, shard, victim);
+    list_unlink(pager, frame_queue_list(shard, frame), victim);
+    return victim;
+}
+
+/*
+Make sure disk space is reserved up to the given file offset. Space
+is reserved in extents of prealloc_size so the file grows in a few
+large, contiguous allocations instead of one block per new page.
+FALLOC_FL_KEEP_SIZE leaves the file length alone, so the length still
+only covers pages that were written.
+*/
+void pager_preallocate(Pager* pager, uint64_t end) {
+    if (pager->prealloc_size == 0 || end <= pager->allocated_length) {
+        return;
+    }
+
+    uint64_t new_length = (end + pager->prealloc_size - 1) /
+                          pager->prealloc_size * pager->prealloc_size;
+    int result = fallocate(pager->file_descriptor, FALLOC_FL_KEEP_SIZE,
+                           pager->allocated_length,
+                           new_length - pager->allocated_length);
+    if (result == -1) {
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            // The file system cannot preallocate; let the file grow as written.
+            pager->prealloc_size = 0;
+            return;
+        }
+        printf("Error preallocating file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->allocated_length = new_length;
+}
+
+/*
+Give back the space reserved past the end of the file, so a closed
+database only occupies the blocks its pages need. Hole punching is
+ignored past the end of the file by some file systems, but truncating
+to the current length frees the blocks beyond it everywhere.
+*/
+void pager_release_preallocation(Pager* pager) {
+    if (pager->allocated_length <= pager->file_length) {
+        return;
+    }
+    if (ftruncate(pager->file_descriptor, pager->file_length) == -1) {
+        printf("Error releasing preallocated space: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->allocated_length = pager->file_length;
+}
+
+/*
+Read a sysfs list of ids such as "0-3,8,10-11". Returns the number of
+ids stored, 0 if the file cannot be read.
+*/
+uint32_t read_id_list(const char* path, uint32_t* ids, uint32_t max_ids) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    uint32_t num_ids = 0;
+    unsigned first;
+    while (fscanf(file, "%u", &first) == 1) {
+        unsigned last = first;
+        int separator = fgetc(file);
+        if (separator == '-') {
+            if (fscanf(file, "%u", &last) != 1) {
+                break;
+            }
+            separator = fgetc(file);
+        }
+        for (unsigned id = first; id <= last && num_ids < max_ids; id++) {
+            ids[num_ids++] = id;
+        }
+        if (separator != ',') {
+            break;
+        }
+    }
+    fclose(file);
+    return num_ids;
+}
+
+/*
+Find the online NUMA nodes and which node each cpu belongs to. Hosts
+without NUMA, or without sysfs, are treated as a single node, and so
+are hosts with node ids too large for the node masks given to mbind.
+*/
+void numa_detect(Pager* pager) {
+    pager->num_nodes = 1;
+    pager->node_ids[0] = 0;
+    pager->cpu_node = NULL;
+    pager->num_cpus = 0;
+
+    uint32_t num_nodes = read_id_list(NUMA_SYSFS_DIR "/online", pager->node_ids,
+                                      NUMA_MAX_NODES);
+    for (uint32_t n = 0; n < num_nodes; n++) {
+        if (pager->node_ids[n] >= NUMA_MAX_NODES) {
+            num_nodes = 1;
+            break;
+        }
+    }
+    if (num_nodes < 2) {
+        pager->node_ids[0] = 0;
+        return;
+    }
+    pager->num_nodes = num_nodes;
+    pager->cpu_node = malloc(sizeof(uint32_t) * NUMA_MAX_CPUS);
+    uint32_t* cpus = malloc(sizeof(uint32_t) * NUMA_MAX_CPUS);
+    for (uint32_t i = 0; i < NUMA_MAX_CPUS; i++) {
+        pager->cpu_node[i] = 0;
+    }
+    for (uint32_t n = 0; n < num_nodes; n++) {
+        char path[64];
+        snprintf(path, sizeof(path), NUMA_SYSFS_DIR "/node%u/cpulist",
+                 pager->node_ids[n]);
+        uint32_t num_cpus = read_id_list(path, cpus, NUMA_MAX_CPUS);
+        for (uint32_t i = 0; i < num_cpus; i++) {
+            if (cpus[i] < NUMA_MAX_CPUS) {
+                pager->cpu_node[cpus[i]] = n;
+                if (cpus[i] >= pager->num_cpus) {
+                    pager->num_cpus = cpus[i] + 1;
+                }
+            }
+        }
+    }
+    free(cpus);
+}
+
+// Index in node_ids of the node of the cpu the calling thread is running on.
+uint32_t numa_current_node(Pager* pager) {
+    if (pager->num_nodes < 2) {
+        return 0;
+    }
+    int cpu = sched_getcpu();
+    if (cpu < 0 || (uint32_t)cpu >= pager->num_cpus) {
+        return 0;
+    }
+    return pager->cpu_node[cpu];
+}
+
+/*
+Ask for each sub-pool's frames to come from its node's memory. The
+policy only prefers the node, so a full node falls back to another
+one instead of failing. If the kernel refuses, for example for huge
+page mappings not aligned to a sub-pool, pages are simply placed on
+the node of the thread that first touches them.
+*/
+void numa_bind_frames(Pager* pager) {
+    if (pager->num_nodes < 2 || pager->frame_arena == NULL) {
+        return;
+    }
+    size_t sub_pool_size = (size_t)pager->frames_per_node * PAGE_SIZE;
+    for (uint32_t s = 0; s < pager->num_shards; s++) {
+        for (uint32_t n = 0; n < pager->num_nodes; n++) {
+            uint64_t node_mask[NUMA_MAX_NODES / 64] = {0};
+            uint32_t node = pager->node_ids[n];
+            node_mask[node / 64] |= (uint64_t)1 << (node % 64);
+            uint32_t first_frame = pager->shards[s].first_frame + n * pager->frames_per_node;
+            syscall(SYS_mbind, pager->frame_arena + (size_t)first_frame * PAGE_SIZE,
+                    sub_pool_size, MPOL_PREFERRED, node_mask, NUMA_MAX_NODES + 1, 0);
+        }
+    }
+}
+
+/*
+Allocate the memory for all frames at once. Explicit huge pages are
+used when the system has some reserved; otherwise the arena is aligned
+to a huge page boundary and offered to transparent huge pages. Pages
+of the arena are only backed by memory once a frame is first used.
+*/
+void frame_arena_alloc(Pager* pager) {
+    size_t size = (size_t)pager->num_frames * PAGE_SIZE;
+    size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    pager->frame_arena_size = size;
+
+    void* arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena != MAP_FAILED) {
+        pager->frame_arena = arena;
+        return;
+    }
+
+    // Over-allocate so the arena can be trimmed to an aligned start.
+    char* region = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        printf("Error allocating frames: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    char* aligned = (char*)(((uintptr_t)region + HUGE_PAGE_SIZE - 1) &
+                            ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > region) {
+        munmap(region, aligned - region);
+    }
+    size_t tail = (region + size + HUGE_PAGE_SIZE) - (aligned + size);
+    if (tail > 0) {
+        munmap(aligned + size, tail);
+    }
+    madvise(aligned, size, MADV_HUGEPAGE);
+    pager->frame_arena = aligned;
+}
+
+void mmap_reserve(Pager* pager) {
+    void* base = mmap(NULL, MMAP_RESERVE_SIZE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        printf("Error reserving address space for mapping: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->map_base = base;
+    pager->map_reserved = MMAP_RESERVE_SIZE;
+    pager->map_length = 0;
+    pager->map_dirty = NULL;
+}
+
+/*
+Extend the file and map the new part over the reserved address space.
+*/
+void mmap_grow(Pager* pager, size_t min_length) {
+    size_t new_length = pager->map_length;
+    while (new_length < min_length) {
+        new_length += MMAP_GROWTH_SIZE;
+    }
+    if (new_length > pager->map_reserved) {
+        printf("Database is larger than the reserved mapping\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (new_length > pager->file_length) {
+        pager_preallocate(pager, new_length);
+        if (ftruncate(pager->file_descriptor, new_length) == -1) {
+            printf("Error extending file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->file_length = new_length;
+    }
+
+    void* mapped = mmap(pager->map_base + pager->map_length,
+                        new_length - pager->map_length,
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                        pager->file_descriptor, pager->map_length);
+    if (mapped == MAP_FAILED) {
+        printf("Error mapping file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t old_pages = pager->map_length / PAGE_SIZE;
+    uint32_t new_pages = new_length / PAGE_SIZE;
+    pager->map_dirty = realloc(pager->map_dirty, sizeof(bool) * new_pages);
+    for (uint32_t i = old_pages; i < new_pages; i++) {
+        pager->map_dirty[i] = false;
+    }
+    __atomic_store_n(&pager->map_length, new_length, __ATOMIC_RELEASE);
+}
+
+void* mmap_get_page(Pager* pager, uint32_t page_num) {
+    size_t end = page_offset(page_num) + PAGE_SIZE;
+    // Pages already mapped and counted can be used without the latch.
+    if (end <= __atomic_load_n(&pager->map_length, __ATOMIC_ACQUIRE) &&
+        page_num < __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE)) {
+        return pager->map_base + page_offset(page_num);
+    }
+
+    pthread_mutex_lock(&pager->latch);
+    if (end > pager->map_length) {
+        mmap_grow(pager, end);
+    }
+    if (page_num >= pager->num_pages) {
+        __atomic_store_n(&pager->num_pages, page_num + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pager->latch);
+    return pager->map_base + page_offset(page_num);
+}
+
+/*
+Count a page as part of the database, reserving disk space for it.
+*/
+void pager_note_page(Pager* pager, uint32_t page_num) {
+    pthread_mutex_lock(&pager->latch);
+    if (page_num >= pager->num_pages) {
+        pager->num_pages = page_num + 1;
+        pager_preallocate(pager, page_offset(pager->num_pages));
+    }
+    pthread_mutex_unlock(&pager->latch);
+}
+
+uint32_t pager_pages_on_disk(Pager* pager) {
+    pthread_mutex_lock(&pager->latch);
+    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+
+    // We might save a partial page at the end of the file
+    if (pager->file_length % PAGE_SIZE) {
+        num_pages += 1;
+    }
+    pthread_mutex_unlock(&pager->latch);
+    return num_pages;
+}
+
+/*
+Bring a set of pages into the pool with all of their reads in flight
+at once. Pages that are already cached are left alone. At most half
+of each shard is filled so that the batch cannot evict itself. The
+shards involved are latched in order for the whole batch.
+*/
+void pager_load_pages(Pager* pager, uint32_t* page_nums, uint32_t count) {
+    if (pager->mode == PAGER_MODE_MMAP) {
+        return;
+    }
+
+    uint32_t num_pages_on_disk = pager_pages_on_disk(pager);
+    uint32_t node = numa_current_node(pager);
+    uint32_t* shard_loads = calloc(pager->num_shards, sizeof(uint32_t));
+    bool* shard_used = calloc(pager->num_shards, sizeof(bool));
+    for (uint32_t i = 0; i < count; i++) {
+        shard_used[pager_shard(pager, page_nums[i]) - pager->shards] = true;
+    }
+    for (uint32_t s = 0; s < pager->num_shards; s++) {
+        if (shard_used[s]) {
+            pthread_mutex_lock(&pager->shards[s].latch);
+        }
+    }
+
+    struct iovec* iov = malloc(sizeof(struct iovec) * count);
+    IoRequest* requests = malloc(sizeof(IoRequest) * count);
+    uint32_t* loaded = malloc(sizeof(uint32_t) * count);
+    uint32_t num_requests = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t page_num = page_nums[i];
+        PagerShard* shard = pager_shard(pager, page_num);
+        uint32_t* shard_load = &shard_loads[shard - pager->shards];
+        if (page_num >= num_pages_on_disk || *shard_load >= pager->frames_per_shard / 2 ||
+            page_table_lookup(pager, shard, page_num) != INVALID_FRAME_NUM) {
+            continue;
+        }
+
+        uint32_t frame_num = pager_claim_frame(pager, shard, node, true);
+        if (frame_num == INVALID_FRAME_NUM) {
+            continue;
+        }
+        Frame* frame = &pager->frames[frame_num];
+        frame->page_num = page_num;
+        frame->dirty = false;
+        frame->pin_count = 0;
+        page_table_insert(pager, shard, frame_num);
+        loaded[num_requests] = frame_num;
+        (*shard_load)++;
+
+        iov[num_requests].iov_base = frame->data;
+        iov[num_requests].iov_len = PAGE_SIZE;
+        IoRequest* request = &requests[num_requests];
+        request->write = false;
+        request->iov = &iov[num_requests];
+        request->iov_count = 1;
+        request->offset = page_offset(page_num);
+        request->length = PAGE_SIZE;
+        num_requests++;
+    }
+    pager_run_io(pager, requests, num_requests);
+    pager_note_read(pager, num_requests, (size_t)num_requests * PAGE_SIZE);
+    for (uint32_t i = 0; i < num_requests; i++) {
+        Frame* frame = &pager->frames[loaded[i]];
+        page_verify_checksum(frame->data, frame->page_num);
+    }
+
+    // Prefetched pages have not been used yet, so they start in A1in.
+    for (uint32_t i = num_requests; i > 0; i--) {
+        Frame* frame = &pager->frames[loaded[i - 1]];
+        frame_enqueue(pager, frame_shard(pager, frame), loaded[i - 1], QUEUE_A1IN);
+    }
+    for (uint32_t s = pager->num_shards; s > 0; s--) {
+        if (shard_used[s - 1]) {
+            pthread_mutex_unlock(&pager->shards[s - 1].latch);
+        }
+    }
+    free(loaded);
+    free(requests);
+    free(iov);
+    free(shard_used);
+    free(shard_loads);
+}
+
+/*
+Called on every cache miss. Misses on consecutive pages, which is what
+a scan over sequentially allocated leaves produces, start a readahead
+window of the pages that follow. With io_uring the window is read
+straight into the pool; otherwise the kernel is asked to prefetch it
+into the page cache so the following preads do not block on the disk.
+*/
+void pager_readahead(Pager* pager, uint32_t page_num) {
+    if (pager->readahead_pages == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pager->latch);
+    if (page_num == pager->sequential_next) {
+        pager->sequential_misses++;
+    } else {
+        pager->sequential_misses = 1;
+        pager->readahead_end = 0;
+    }
+    pager->sequential_next = page_num + 1;
+
+    // Stay half a window ahead of the scan.
+    if (pager->sequential_misses < READAHEAD_TRIGGER ||
+        pager->readahead_end > page_num + pager->readahead_pages / 2) {
+        pthread_mutex_unlock(&pager->latch);
+        return;
+    }
+
+    uint32_t first = page_num + 1;
+    if (pager->readahead_end > first) {
+        first = pager->readahead_end;
+    }
+    uint32_t end = page_num + 1 + pager->readahead_pages;
+    uint32_t num_pages_on_disk = pager_pages_on_disk(pager);
+    if (end > num_pages_on_disk) {
+        end = num_pages_on_disk;
+    }
+    if (first >= end) {
+        pthread_mutex_unlock(&pager->latch);
+        return;
+    }
+    pager->readahead_end = end;
+    if (pager->io_ring != NULL) {
+        // The window will be cached, so the scan next misses past it.
+        pager->sequential_next = end;
+    }
+    pthread_mutex_unlock(&pager->latch);
+
+    // Shard latches must not be taken while holding the pager latch.
+    if (pager->io_ring != NULL) {
+        uint32_t page_nums[end - first];
+        for (uint32_t i = first; i < end; i++) {
+            page_nums[i - first] = i;
+        }
+        pager_load_pages(pager, page_nums, end - first);
+    } else {
+        posix_fadvise(pager->file_descriptor, page_offset(first),
+                      page_offset(end - first), POSIX_FADV_WILLNEED);
+    }
+}
+
+uint32_t pager_frames_used(Pager* pager) {
+    uint32_t frames_used = 0;
+    for (uint32_t i = 0; i < pager->num_shards; i++) {
+        pthread_mutex_lock(&pager->shards[i].latch);
+        frames_used += pager->shards[i].num_frames_used;
+        pthread_mutex_unlock(&pager->shards[i].latch);
+    }
+    return frames_used;
+}
+
+struct WarmPage_t {
+    uint32_t page_num;
+    double recency;  // 1 for the page its shard used last
+};
+typedef struct WarmPage_t WarmPage;
+
+int compare_warm_page_recency(const void* a, const void* b) {
+    double recency_a = ((WarmPage*)a)->recency;
+    double recency_b = ((WarmPage*)b)->recency;
+    return (recency_a < recency_b) - (recency_a > recency_b);
+}
+
+/*
+Write the numbers of the cached pages to the warm-up file, most
+recently used first. Each shard keeps its own access clock, so pages
+are ordered by how recent they are relative to their shard's clock.
+*/
+void pager_save_warm_pages(Pager* pager) {
+    FILE* file = fopen(pager->warm_path, "w");
+    if (file == NULL) {
+        printf("Unable to write warm-up file: %d\n", errno);
+        return;
+    }
+    WarmPage* pages = malloc(sizeof(WarmPage) * pager->num_frames);
+    uint32_t count = 0;
+    for (uint32_t s = 0; s < pager->num_shards; s++) {
+        PagerShard* shard = &pager->shards[s];
+        for (uint32_t i = 0; i < pager->frames_per_shard; i++) {
+            Frame* frame = &pager->frames[shard->first_frame + i];
+            if (!frame_in_use(frame)) {
+                continue;
+            }
+            pages[count].page_num = frame->page_num;
+            pages[count].recency = (double)frame->last_access / shard->access_clock;
+            count++;
+        }
+    }
+    qsort(pages, count, sizeof(WarmPage), compare_warm_page_recency);
+    for (uint32_t i = 0; i < count; i++) {
+        fprintf(file, "%u\n", pages[i].page_num);
+    }
+    free(pages);
+    fclose(file);
+}
+
+int compare_page_num(const void* a, const void* b) {
+    uint32_t page_a = *(uint32_t*)a;
+    uint32_t page_b = *(uint32_t*)b;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+/*
+Reload the pages listed in the warm-up file. Only as many of the most
+recent pages as fit in the pool are kept, and they are read in page
+order. The kernel is asked to prefetch them all first, so the batches
+read under the latch mostly come from the page cache.
+*/
+void* warmup_main(void* arg) {
+    Pager* pager = arg;
+    FILE* file = fopen(pager->warm_path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    uint32_t* page_nums = malloc(sizeof(uint32_t) * pager->num_frames);
+    uint32_t count = 0;
+    while (count < pager->num_frames && fscanf(file, "%u", &page_nums[count]) == 1) {
+        count++;
+    }
+    fclose(file);
+    qsort(page_nums, count, sizeof(uint32_t), compare_page_num);
+
+    for (uint32_t i = 0; i < count; i++) {
+        posix_fadvise(pager->file_descriptor, page_offset(page_nums[i]), PAGE_SIZE,
+                      POSIX_FADV_WILLNEED);
+    }
+    uint32_t batch_size = WARMUP_BATCH_PAGES;
+    if (batch_size > pager->num_frames / 2) {
+        batch_size = pager->num_frames / 2;
+    }
+    for (uint32_t i = 0; i < count; i += batch_size) {
+        // Once the pool is full, loading more would evict pages in use.
+        pthread_mutex_lock(&pager->latch);
+        bool stop = pager->warmup_stop;
+        pthread_mutex_unlock(&pager->latch);
+        if (stop || pager_frames_used(pager) == pager->num_frames) {
+            break;
+        }
+        uint32_t batch = count - i < batch_size ? count - i : batch_size;
+        pager_load_pages(pager, &page_nums[i], batch);
+    }
+    free(page_nums);
+    return NULL;
+}
+
+/*
+Pin a page in the pool and return a pointer to it. A pinned frame is
+never evicted, so the pointer stays valid until the matching
+unpin_page; every pin must be paired with exactly one unpin.
+*/
+void* pager_pin_page(Pager* pager, uint32_t page_num, PageAccess access) {
+    if (pager->mode == PAGER_MODE_MMAP) {
+        // Mapped pages never move, so there is nothing to pin.
+        return mmap_get_page(pager, page_num);
+    }
+
+    PagerShard* shard = pager_shard(pager, page_num);
+    uint32_t node = numa_current_node(pager);
+    pthread_mutex_lock(&shard->latch);
+    uint32_t frame_num = page_table_lookup(pager, shard, page_num);
+    if (frame_num != INVALID_FRAME_NUM) {
+        // Cache hit. Scans leave the queues alone.
+        Frame* frame = &pager->frames[frame_num];
+        if (frame_node(pager, frame_num) != node) {
+            shard->stats.remote_accesses++;
+        }
+        if (access == PAGE_ACCESS_NORMAL &&
+            (frame->queue == QUEUE_AM || !frame_is_correlated(pager, shard, frame))) {
+            list_unlink(pager, frame_queue_list(shard, frame), frame_num);
+            frame_enqueue(pager, shard, frame_num, QUEUE_AM);
+        } else {
+            frame->last_access = ++shard->access_clock;
+        }
+        frame->pin_count++;
+        shard->stats.hits++;
+        pthread_mutex_unlock(&shard->latch);
+        return frame->data;
+    }
+
+    // Cache miss. Claim a frame and load from file.
+    frame_num = pager_claim_frame(pager, shard, node, false);
+    Frame* frame = &pager->frames[frame_num];
+    void* page = frame->data;
+    if (frame_node(pager, frame_num) != node) {
+        shard->stats.remote_accesses++;
+    }
+
+    shard->stats.misses++;
+    memset(page, 0, PAGE_SIZE);
+    if (page_num < pager_pages_on_disk(pager)) {
+        uint64_t start = monotonic_ns();
+        ssize_t bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE,
+                                   page_offset(page_num));
+        if (bytes_read == -1) {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager_note_io_time(pager, monotonic_ns() - start);
+        pager_note_read(pager, 1, bytes_read);
+        page_verify_checksum(page, page_num);
+    }
+
+    frame->page_num = page_num;
+    frame->dirty = false;
+    frame->pin_count = 1;
+    page_table_insert(pager, shard, frame_num);
+    // A page seen again soon after leaving A1in is hot, unless a scan is reading it.
+    if (ghost_remove(pager, shard, page_num) && access == PAGE_ACCESS_NORMAL) {
+        frame_enqueue(pager, shard, frame_num, QUEUE_AM);
+    } else {
+        frame_enqueue(pager, shard, frame_num, QUEUE_A1IN);
+    }
+    pthread_mutex_unlock(&shard->latch);
+
+    pager_note_page(pager, page_num);
+    pager_readahead(pager, page_num);
+    return page;
+}
+
+void* pin_page(Pager* pager, uint32_t page_num) {
+    return pager_pin_page(pager, page_num, PAGE_ACCESS_NORMAL);
+}
+
+void unpin_page(Pager* pager, uint32_t page_num) {
+    if (pager->mode == PAGER_MODE_MMAP) {
+        return;
+    }
+
+    PagerShard* shard = pager_shard(pager, page_num);
+    pthread_mutex_lock(&shard->latch);
+    uint32_t frame_num = page_table_lookup(pager, shard, page_num);
+    if (frame_num == INVALID_FRAME_NUM || pager->frames[frame_num].pin_count == 0) {
+        printf("Tried to unpin page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame_num].pin_count--;
+    pthread_mutex_unlock(&shard->latch);
+}
+
+/*
+Every code path that modifies a page must call this, or the change
+will be lost when the page is evicted or the database is closed.
+*/
+void pager_mark_dirty(Pager* pager, uint32_t page_num) {
+    if (pager->mode == PAGER_MODE_MMAP) {
+        // The dirty map moves when the mapping grows.
+        pthread_mutex_lock(&pager->latch);
+        pager->map_dirty[page_num] = true;
+        pthread_mutex_unlock(&pager->latch);
+        return;
+    }
+
+    PagerShard* shard = pager_shard(pager, page_num);
+    pthread_mutex_lock(&shard->latch);
+    uint32_t frame_num = page_table_lookup(pager, shard, page_num);
+    if (frame_num == INVALID_FRAME_NUM) {
+        printf("Tried to mark page %d dirty but it is not cached\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    Frame* frame = &pager->frames[frame_num];
+    if (!frame->dirty) {
+        frame->dirty = true;
+        shard->num_dirty++;
+        if (pager->bg_writer) {
+            frame->dirtied_at = monotonic_ms();
+            if (shard->num_dirty > pager->dirty_target) {
+                pthread_cond_signal(&pager->writer_wake);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->latch);
+}
+
+void indent(uint32_t level) {
+    for (uint32_t i = 0; i < level; i++) {
+        printf("  ");
+    }
+}
+
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+    void* node = pin_page(pager, page_num);
+    uint32_t num_keys, child;
+
+    switch (get_node_type(node)) {
+        case (NODE_LEAF):
+            num_keys = *leaf_node_num_cells(node);
+            indent(indentation_level);
+            printf("- leaf (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                indent(indentation_level + 1);
+                printf("- %d\n", *leaf_node_key(node, i));
+            }
+            break;
+        case (NODE_INTERNAL):
+            num_keys = *internal_node_num_keys(node);
+            indent(indentation_level);
+            printf("- internal (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                child = *internal_node_child(node, i);
+                print_tree(pager, child, indentation_level + 1);
+
+                indent(indentation_level);
+                printf("- key %d\n", *internal_node_key(node, i));
+            }
+            child = *internal_node_right_child(node);
+            print_tree(pager, child, indentation_level + 1);
+            break;
+    }
+    unpin_page(pager, page_num);
+}
+
+void initialize_leaf_node(void* node) {
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+    *leaf_node_prev_leaf(node) = 0;
+}
+
+void initialize_internal_node(void* node) {
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+}
+
+/*
+Reuse a page from the freelist if there is one, otherwise new pages
+go onto the end of the database file. The caller must initialize the
+page; a recycled page still holds its old contents.
+*/
+uint32_t get_unused_page_num(Pager* pager) {
+    if (pager->freelist_head == 0) {
+        if (pager->num_pages == INVALID_PAGE_NUM) {
+            printf("Database is full: page numbers exhausted.\n");
+            exit(EXIT_FAILURE);
+        }
+        return pager->num_pages;
+    }
+
+    uint32_t trunk_page_num = pager->freelist_head;
+    void* trunk = pin_page(pager, trunk_page_num);
+    uint32_t count = *freelist_trunk_count(trunk);
+    uint32_t page_num;
+    pager->freelist_count--;
+    if (count > 0) {
+        *freelist_trunk_count(trunk) = count - 1;
+        pager_mark_dirty(pager, trunk_page_num);
+        page_num = *freelist_trunk_entry(trunk, count - 1);
+    } else {
+        // The trunk has no entries left, so hand out the trunk page itself.
+        pager->freelist_head = *freelist_trunk_next(trunk);
+        page_num = trunk_page_num;
+    }
+    unpin_page(pager, trunk_page_num);
+    return page_num;
+}
+
+/*
+Return a page that is no longer referenced by the tree to the
+freelist. It is added to the head trunk if that has room, otherwise
+the page itself becomes the new head trunk.
+*/
+void free_page(Pager* pager, uint32_t page_num) {
+    pager->freelist_count++;
+    if (pager->freelist_head != 0) {
+        uint32_t trunk_page_num = pager->freelist_head;
+        void* trunk = pin_page(pager, trunk_page_num);
+        uint32_t count = *freelist_trunk_count(trunk);
+        if (count < FREELIST_TRUNK_MAX_ENTRIES) {
+            *freelist_trunk_entry(trunk, count) = page_num;
+            *freelist_trunk_count(trunk) = count + 1;
+            pager_mark_dirty(pager, trunk_page_num);
+            unpin_page(pager, trunk_page_num);
+            return;
+        }
+        unpin_page(pager, trunk_page_num);
+    }
+
+    void* page = pin_page(pager, page_num);
+    *freelist_trunk_next(page) = pager->freelist_head;
+    *freelist_trunk_count(page) = 0;
+    pager_mark_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+    pager->freelist_head = page_num;
+}
+
+void create_new_root(Table* table, uint32_t separator_key, uint32_t right_child_page_num) {
+    /*
+    Handle splitting the root.
+    Old root becomes the left child and stays where it is.
+    Address of right child and the key separating the two passed in.
+    Allocate a new page for the root and record it in the header.
+    New root node points to two children.
+    */
+
+    uint32_t left_child_page_num = table->root_page_num;
+    void *left_child = pin_page(table->pager, left_child_page_num);
+    void *right_child = pin_page(table->pager, right_child_page_num);
+    uint32_t root_page_num = get_unused_page_num(table->pager);
+    void *root = pin_page(table->pager, root_page_num);
+
+    /* Root node is a new internal node with one key and two children */
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *node_parent(root) = 0;
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    *internal_node_key(root, 0) = separator_key;
+    *internal_node_right_child(root) = right_child_page_num;
+
+    set_node_root(left_child, false);
+    *node_parent(left_child) = root_page_num;
+    *node_parent(right_child) = root_page_num;
+    table->root_page_num = root_page_num;
+
+    pager_mark_dirty(table->pager, root_page_num);
+    pager_mark_dirty(table->pager, left_child_page_num);
+    pager_mark_dirty(table->pager, right_child_page_num);
+    unpin_page(table->pager, root_page_num);
+    unpin_page(table->pager, right_child_page_num);
+    unpin_page(table->pager, left_child_page_num);
+}
+
+// Index of the child that may contain the given key.
+uint32_t internal_node_find_child(void* node, uint32_t key) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    /* Binary search to find index of child to search */
+    uint32_t min_index = 0;
+    uint32_t max_index = num_keys; /* there is one more child than key */
+
+    while (min_index != max_index) {
+        uint32_t index = (min_index + max_index) / 2;
+        uint32_t key_to_right = *internal_node_key(node, index);
+        if (key_to_right >= key) {
+            max_index = index;
+        } else {
+            min_index = index + 1;
+        }
+    }
+    return min_index;
+}
+
+void set_parent(Pager* pager, uint32_t page_num, uint32_t parent_page_num) {
+    void* node = pin_page(pager, page_num);
+    *node_parent(node) = parent_page_num;
+    pager_mark_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+}
+
+// Write children[0..num_keys] and keys[0..num_keys - 1] into a node.
+void internal_node_fill(void* node, uint32_t* children, uint32_t* keys,
+                        uint32_t num_keys) {
+    *internal_node_num_keys(node) = num_keys;
+    for (uint32_t i = 0; i < num_keys; i++) {
+        *internal_node_cell(node, i) = children[i];
+        *internal_node_key(node, i) = keys[i];
+    }
+    *internal_node_right_child(node) = children[num_keys];
 }
 
 /*
-Until we start recycling free pages, new pages will always
-go onto the end of the database file
+A child of the internal node at parent_page_num has split into
+left_child_page_num, which keeps its place, and right_child_page_num,
+with separator_key the largest key under the left half. Add the right
+half after the left one. A full node is split in turn: the lower half
+of its children stays, the upper half moves to a new node, and the
+key between the halves goes up a level, growing a new root when the
+split node was the root.
 */
-uint32_t get_unused_page_num(Pager* pager) { return pager->num_pages; }
-
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-    /*
-    Handle splitting the root.
-    Old root copied to new page, becomes left child.
-    Address of right child passed in.
-    Re-initialize root page to contain the new root node.
-    New root node points to two children.
-    */
-
-    void *root = get_page(table->pager, table->root_page_num);
-    void *right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void *left_child = get_page(table->pager, left_child_page_num);
+void internal_node_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t left_child_page_num, uint32_t separator_key,
+                          uint32_t right_child_page_num) {
+    Pager* pager = table->pager;
+    void* parent = pin_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t index = internal_node_find_child(parent, separator_key);
+    if (*internal_node_child(parent, index) != left_child_page_num) {
+        printf("Child %d not found in parent %d.\n", left_child_page_num, parent_page_num);
+        exit(EXIT_FAILURE);
+    }
 
-    /* Left child has data copied from old root */
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
+    // Lay out the children and keys with the new child in place.
+    uint32_t* children = malloc(sizeof(uint32_t) * (num_keys + 2));
+    uint32_t* keys = malloc(sizeof(uint32_t) * (num_keys + 1));
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        children[i <= index ? i : i + 1] = *internal_node_child(parent, i);
+        if (i < num_keys) {
+            // The old key of the split child now bounds its right half.
+            keys[i < index ? i : i + 1] = *internal_node_key(parent, i);
+        }
+    }
+    keys[index] = separator_key;
+    children[index + 1] = right_child_page_num;
+    num_keys++;
+    set_parent(pager, right_child_page_num, parent_page_num);
+
+    if (num_keys <= INTERNAL_NODE_MAX_KEYS) {
+        internal_node_fill(parent, children, keys, num_keys);
+        pager_mark_dirty(pager, parent_page_num);
+        unpin_page(pager, parent_page_num);
+        free(keys);
+        free(children);
+        return;
+    }
 
-    /* Root node is a new internal node with one key and two children */
-    initialize_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
+    uint32_t left_num_keys = num_keys / 2;
+    uint32_t right_num_keys = num_keys - left_num_keys - 1;
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = pin_page(pager, new_page_num);
+    initialize_internal_node(new_node);
+    internal_node_fill(parent, children, keys, left_num_keys);
+    internal_node_fill(new_node, &children[left_num_keys + 1], &keys[left_num_keys + 1],
+                       right_num_keys);
+    for (uint32_t i = left_num_keys + 1; i <= num_keys; i++) {
+        set_parent(pager, children[i], new_page_num);
+    }
+    pager_mark_dirty(pager, parent_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    unpin_page(pager, new_page_num);
+    table->splits++;
+
+    uint32_t up_key = keys[left_num_keys];
+    free(keys);
+    free(children);
+    if (is_node_root(parent)) {
+        unpin_page(pager, parent_page_num);
+        create_new_root(table, up_key, new_page_num);
+    } else {
+        uint32_t grandparent_page_num = *node_parent(parent);
+        unpin_page(pager, parent_page_num);
+        internal_node_insert(table, grandparent_page_num, parent_page_num, up_key,
+                             new_page_num);
+    }
 }
 
 void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
@@ -372,10 +2506,21 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
     Update parent or create a new parent.
     */
 
-    void* old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void* new_node = get_page(cursor->table->pager, new_page_num);
+    Pager* pager = cursor->table->pager;
+    void* old_node = cursor->node;
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = pin_page(pager, new_page_num);
     initialize_leaf_node(new_node);
+    uint32_t next_page_num = *leaf_node_next_leaf(old_node);
+    if (next_page_num != 0) {
+        void* next_node = pin_page(pager, next_page_num);
+        *leaf_node_prev_leaf(next_node) = new_page_num;
+        pager_mark_dirty(pager, next_page_num);
+        unpin_page(pager, next_page_num);
+    }
+    *leaf_node_next_leaf(new_node) = next_page_num;
+    *leaf_node_prev_leaf(new_node) = cursor->page_num;
+    *leaf_node_next_leaf(old_node) = new_page_num;
 
     /*
     All existing keys plus new key should be divided
@@ -394,7 +2539,8 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
         void* destination = leaf_node_cell(destination_node, index_within_node);
 
         if (i == cursor->cell_num) {
-            serialize_row(value, destination);
+            *leaf_node_key(destination_node, index_within_node) = key;
+            serialize_row(value, leaf_node_value(destination_node, index_within_node));
         } else if (i > cursor->cell_num) {
             memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
         } else {
@@ -405,17 +2551,22 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
     /* Update cell count on both leaf nodes */
     *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
     *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    pager_mark_dirty(pager, cursor->page_num);
+    pager_mark_dirty(pager, new_page_num);
+    unpin_page(pager, new_page_num);
+    cursor->table->splits++;
 
+    uint32_t separator_key = get_node_max_key(old_node);
     if (is_node_root(old_node)) {
-        return create_new_root(cursor->table, new_page_num);
+        create_new_root(cursor->table, separator_key, new_page_num);
     } else {
-        printf("Need to implement updating parent after split\n");
-        exit(EXIT_FAILURE);
+        internal_node_insert(cursor->table, *node_parent(old_node), cursor->page_num,
+                             separator_key, new_page_num);
     }
 }
 
 void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-    void* node = get_page(cursor->table->pager, cursor->page_num);
+    void* node = cursor->node;
 
     uint32_t num_cells = *leaf_node_num_cells(node);
     if (num_cells >= LEAF_NODE_MAX_CELLS) {
@@ -434,28 +2585,23 @@ void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
     *(leaf_node_num_cells(node)) += 1;
     *(leaf_node_key(node, cursor->cell_num)) = key;
     serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
 }
 
-Cursor* table_start(Table* table) {
-    Cursor* cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = table->root_page_num;
-    cursor->cell_num = 0;
-
-    void* root_node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = *leaf_node_num_cells(root_node);
-    cursor->end_of_table = (num_cells == 0);
-
-    return cursor;
+void cursor_close(Cursor* cursor) {
+    unpin_page(cursor->table->pager, cursor->page_num);
+    free(cursor);
 }
 
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-    void* node = get_page(table->pager, page_num);
+    void* node = pin_page(table->pager, page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
 
     Cursor* cursor = malloc(sizeof(Cursor));
     cursor->table = table;
     cursor->page_num = page_num;
+    cursor->node = node;
+    cursor->access = PAGE_ACCESS_NORMAL;
 
     // binary search
     uint32_t min_index = 0;
@@ -478,26 +2624,14 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
 }
 
 Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-    void* node = get_page(table->pager, page_num);
-    uint32_t num_keys = *internal_node_num_keys(node);
-
-    /* Binary search to find index of child to search */
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys; /* there is one more child than key */
-
-    while (min_index != max_index) {
-        uint32_t index = (min_index + max_index) / 2;
-        uint32_t key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key) {
-            max_index = index;
-        } else {
-            min_index = index + 1;
-        }
-    }
-
-    uint32_t child_num = *internal_node_child(node, min_index);
-    void* child = get_page(table->pager, child_num);
-    switch (get_node_type(child)) {
+    void* node = pin_page(table->pager, page_num);
+    uint32_t child_num = *internal_node_child(node, internal_node_find_child(node, key));
+    unpin_page(table->pager, page_num);
+
+    void* child = pin_page(table->pager, child_num);
+    NodeType child_type = get_node_type(child);
+    unpin_page(table->pager, child_num);
+    switch (child_type) {
         case NODE_LEAF:
             return leaf_node_find(table, child_num, key);
         case NODE_INTERNAL:
@@ -512,32 +2646,113 @@ where it should be inserted
 */
 Cursor* table_find(Table* table, uint32_t key) {
     uint32_t root_page_num = table->root_page_num;
-    void* root_node = get_page(table->pager, table->root_page_num);
+    void* root_node = pin_page(table->pager, root_page_num);
+    NodeType root_type = get_node_type(root_node);
+    unpin_page(table->pager, root_page_num);
 
-    if (get_node_type(root_node) == NODE_LEAF) {
+    if (root_type == NODE_LEAF) {
         return leaf_node_find(table, root_page_num, key);
     } else {
         return internal_node_find(table, root_page_num, key);
     }
 }
 
+/*
+While the cursor is past the last cell of its leaf, move it, and its
+pin, to the first cell of the next leaf. Past the rightmost leaf it is
+at the end of the table.
+*/
+void cursor_skip_to_next_leaf(Cursor* cursor) {
+    Pager* pager = cursor->table->pager;
+    while (cursor->cell_num >= (*leaf_node_num_cells(cursor->node))) {
+        uint32_t next_page_num = *leaf_node_next_leaf(cursor->node);
+        if (next_page_num == 0) {
+            /* This was rightmost leaf */
+            cursor->end_of_table = true;
+            return;
+        }
+        unpin_page(pager, cursor->page_num);
+        cursor->page_num = next_page_num;
+        cursor->cell_num = 0;
+        cursor->node = pager_pin_page(pager, next_page_num, cursor->access);
+    }
+}
+
+/*
+Position a cursor at the first key >= key. table_find can stop at the
+end of a leaf, because internal node keys are only upper bounds for
+their children, so the cursor may have to move on to the next leaf.
+*/
+Cursor* table_seek(Table* table, uint32_t key) {
+    Cursor* cursor = table_find(table, key);
+    cursor->end_of_table = false;
+    cursor_skip_to_next_leaf(cursor);
+    return cursor;
+}
+
+/*
+A cursor keeps the leaf it points into pinned, so cursor_value can
+hand out pointers straight into the frame. Release it with
+cursor_close. A scan starts at the leftmost leaf, where key 0 would
+go, and follows the leaves' next pointers from there.
+*/
+Cursor* table_start(Table* table) {
+    Cursor* cursor = table_seek(table, 0);
+    cursor->access = PAGE_ACCESS_SCAN;
+    return cursor;
+}
+
 void* cursor_value(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* page = get_page(cursor->table->pager, page_num);
-    return leaf_node_value(page, cursor->cell_num);
+    return leaf_node_value(cursor->node, cursor->cell_num);
 }
 
-void cursor_advance(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
+uint32_t cursor_key(Cursor* cursor) {
+    return *leaf_node_key(cursor->node, cursor->cell_num);
+}
 
+void cursor_advance(Cursor* cursor) {
     cursor->cell_num += 1;
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-        cursor->end_of_table = true;
+    cursor_skip_to_next_leaf(cursor);
+}
+
+/*
+Step the cursor back one cell, moving it and its pin to the last cell
+of the previous leaf when it is at the start of one. Before the first
+cell of the leftmost leaf it is at the end of the table, since that is
+where a backward scan ends.
+*/
+void cursor_retreat(Cursor* cursor) {
+    Pager* pager = cursor->table->pager;
+    while (cursor->cell_num == 0) {
+        uint32_t prev_page_num = *leaf_node_prev_leaf(cursor->node);
+        if (prev_page_num == 0) {
+            /* This was leftmost leaf */
+            cursor->end_of_table = true;
+            return;
+        }
+        unpin_page(pager, cursor->page_num);
+        cursor->page_num = prev_page_num;
+        cursor->node = pager_pin_page(pager, prev_page_num, cursor->access);
+        cursor->cell_num = *leaf_node_num_cells(cursor->node);
     }
+    cursor->cell_num -= 1;
+}
+
+/*
+Position a cursor at the last row, for scanning backward with
+cursor_retreat. Ids never reach UINT32_MAX, so finding it lands one
+past the last cell of the rightmost leaf.
+*/
+Cursor* table_end(Table* table) {
+    Cursor* cursor = table_find(table, UINT32_MAX);
+    cursor->access = PAGE_ACCESS_SCAN;
+    cursor->end_of_table = false;
+    cursor_retreat(cursor);
+    return cursor;
 }
 
-Pager* pager_open(const char* filename) {
+Pager* pager_open(const char* filename, PagerConfig* config) {
+    crc32c_init();
     int fd = open(filename,
                   O_RDWR |  // Read/Write mode
                   O_CREAT,  // Create file if it does not exist
@@ -552,52 +2767,199 @@ Pager* pager_open(const char* filename) {
     off_t file_length = lseek(fd, 0, SEEK_END);
 
     Pager* pager = malloc(sizeof(Pager));
+    pager->mode = config->mode;
     pager->file_descriptor = fd;
     pager->file_length = file_length;
     pager->num_pages = (file_length / PAGE_SIZE);
+    pager->allocated_length = file_length;
+    pager->prealloc_size = (uint64_t)config->prealloc_mb << 20;
 
     if (file_length % PAGE_SIZE != 0) {
         printf("Db file is not a whole number of pages. corrumpt file.\n");
         exit(EXIT_FAILURE);
     }
 
-    for (uint32_t i = 0; i< TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+    numa_detect(pager);
+    if (!config->numa || pager->mode == PAGER_MODE_MMAP) {
+        pager->num_nodes = 1;
     }
-    return pager;
-}
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-    if (pager->pages[page_num] == NULL) {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
+    // Every shard gets the same number of frames, and at least the minimum.
+    pager->num_shards = config->num_shards;
+    if (pager->num_shards == 0) {
+        pager->num_shards = config->num_frames / PAGER_MIN_FRAMES;
+        if (pager->num_shards > PAGER_MAX_SHARDS) {
+            pager->num_shards = PAGER_MAX_SHARDS;
+        }
+        if (pager->num_shards == 0) {
+            pager->num_shards = 1;
+        }
     }
+    pager->frames_per_shard =
+        (config->num_frames + pager->num_shards - 1) / pager->num_shards;
+    if (pager->frames_per_shard < PAGER_MIN_FRAMES) {
+        pager->frames_per_shard = PAGER_MIN_FRAMES;
+    }
+    // Every node gets a sub-pool of the same size in each shard.
+    pager->frames_per_node =
+        (pager->frames_per_shard + pager->num_nodes - 1) / pager->num_nodes;
+    pager->frames_per_shard = pager->frames_per_node * pager->num_nodes;
+    pager->num_frames = pager->frames_per_shard * pager->num_shards;
+    pager->frames = malloc(sizeof(Frame) * pager->num_frames);
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        pager->frames[i].data = NULL;
+    }
+    pager->frame_arena = NULL;
+    if (pager->mode == PAGER_MODE_BUFFERED) {
+        frame_arena_alloc(pager);
+    }
+    pager->a1in_target = pager->frames_per_shard * TWO_Q_A1IN_PERCENT / 100;
+    pager->protected_accesses = PAGER_PROTECTED_ACCESSES / pager->num_shards;
+    if (pager->protected_accesses == 0) {
+        pager->protected_accesses = 1;
+    }
+    pager->ghost_capacity = pager->frames_per_shard * TWO_Q_A1OUT_PERCENT / 100;
+    pager->dirty_target = pager->frames_per_shard * config->dirty_ratio / 100;
+    pager->freelist_head = 0;
+    pager->freelist_count = 0;
+    pager->stats = (PagerStats){0};
+
+    // Keep the readahead window well below the pool size.
+    pager->readahead_pages = config->readahead_pages;
+    if (pager->readahead_pages > pager->num_frames / 4) {
+        pager->readahead_pages = pager->num_frames / 4;
+    }
+    pager->sequential_next = INVALID_PAGE_NUM;
+    pager->sequential_misses = 0;
+    pager->readahead_end = 0;
+
+    // Keep hash chains short: at least two buckets per frame.
+    uint32_t num_buckets = 1;
+    while (num_buckets < pager->frames_per_shard * 2) {
+        num_buckets <<= 1;
+    }
+    pager->page_table_mask = num_buckets - 1;
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pager->shards = malloc(sizeof(PagerShard) * pager->num_shards);
+    for (uint32_t s = 0; s < pager->num_shards; s++) {
+        PagerShard* shard = &pager->shards[s];
+        pthread_mutex_init(&shard->latch, NULL);
+        pthread_cond_init(&shard->writes_done, &cond_attr);
+        shard->first_frame = s * pager->frames_per_shard;
+        shard->num_frames_used = 0;
+        shard->node_frames_used = calloc(pager->num_nodes, sizeof(uint32_t));
+        shard->a1in = (FrameList){INVALID_FRAME_NUM, INVALID_FRAME_NUM, 0};
+        shard->am = (FrameList){INVALID_FRAME_NUM, INVALID_FRAME_NUM, 0};
+        shard->access_clock = 0;
+        shard->page_table = malloc(sizeof(uint32_t) * num_buckets);
+        shard->ghost_table = malloc(sizeof(uint32_t) * num_buckets);
+        for (uint32_t i = 0; i < num_buckets; i++) {
+            shard->page_table[i] = INVALID_FRAME_NUM;
+            shard->ghost_table[i] = INVALID_FRAME_NUM;
+        }
+        shard->ghost_pages = malloc(sizeof(uint32_t) * pager->ghost_capacity);
+        shard->ghost_next = malloc(sizeof(uint32_t) * pager->ghost_capacity);
+        for (uint32_t i = 0; i < pager->ghost_capacity; i++) {
+            shard->ghost_pages[i] = INVALID_PAGE_NUM;
+        }
+        shard->ghost_oldest = 0;
+        shard->num_dirty = 0;
+        shard->writes_in_flight = 0;
+        shard->stats = (PagerStats){0};
+    }
+    numa_bind_frames(pager);
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+    if (pager->mode == PAGER_MODE_MMAP) {
+        mmap_reserve(pager);
+        if (file_length > 0) {
+            mmap_grow(pager, file_length);
+        }
     }
 
-    ssize_t bytes_written =
-            write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+    pager->io_ring = NULL;
+    if (config->use_io_uring && pager->mode == PAGER_MODE_BUFFERED) {
+        pager->io_ring = malloc(sizeof(IoRing));
+        if (!io_ring_init(pager->io_ring, IO_RING_ENTRIES)) {
+            free(pager->io_ring);
+            pager->io_ring = NULL;
+        }
+    }
 
-    if (bytes_written == -1) {
-        printf("Error writing: %d\n", errno);
+    // Recursive so that I/O accounting can be done while holding it.
+    pthread_mutexattr_t latch_attr;
+    pthread_mutexattr_init(&latch_attr);
+    pthread_mutexattr_settype(&latch_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&pager->latch, &latch_attr);
+    pthread_mutexattr_destroy(&latch_attr);
+    pthread_mutex_init(&pager->ring_latch, NULL);
+    pthread_cond_init(&pager->writer_wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    pager->writer_stop = false;
+    pager->dirty_max_age_ms = config->dirty_age_ms;
+    // Mapped pages are written back by the kernel already.
+    pager->bg_writer = config->bg_writer && pager->mode == PAGER_MODE_BUFFERED;
+    if (pager->bg_writer &&
+        pthread_create(&pager->writer_thread, NULL, bg_writer_main, pager) != 0) {
+        printf("Error starting background writer\n");
         exit(EXIT_FAILURE);
     }
+
+    pager->warm_path = NULL;
+    pager->warmup_running = false;
+    pager->warmup_stop = false;
+    if (config->warmup && pager->mode == PAGER_MODE_BUFFERED) {
+        pager->warm_path = malloc(strlen(filename) + sizeof(WARM_FILE_SUFFIX));
+        strcpy(pager->warm_path, filename);
+        strcat(pager->warm_path, WARM_FILE_SUFFIX);
+        if (access(pager->warm_path, R_OK) == 0) {
+            if (pthread_create(&pager->warmup_thread, NULL, warmup_main, pager) != 0) {
+                printf("Error starting cache warm-up\n");
+                exit(EXIT_FAILURE);
+            }
+            pager->warmup_running = true;
+        }
+    }
+    return pager;
 }
 
-void db_close(Table* table) {
-    Pager* pager = table->pager;
-    for (uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
+void pager_close(Pager* pager) {
+    if (pager->warmup_running) {
+        pthread_mutex_lock(&pager->latch);
+        pager->warmup_stop = true;
+        pthread_mutex_unlock(&pager->latch);
+        pthread_join(pager->warmup_thread, NULL);
+    }
+    if (pager->warm_path != NULL) {
+        pager_save_warm_pages(pager);
+        free(pager->warm_path);
+    }
+    if (pager->bg_writer) {
+        pthread_mutex_lock(&pager->latch);
+        pager->writer_stop = true;
+        pthread_cond_signal(&pager->writer_wake);
+        pthread_mutex_unlock(&pager->latch);
+        pthread_join(pager->writer_thread, NULL);
+    }
+    pager_flush_all(pager);
+    pager_release_preallocation(pager);
+
+    if (pager->mode == PAGER_MODE_MMAP) {
+        munmap(pager->map_base, pager->map_reserved);
+        free(pager->map_dirty);
+        // The mapping grows in chunks; drop the unused tail of the file.
+        if (ftruncate(pager->file_descriptor, page_offset(pager->num_pages)) == -1) {
+            printf("Error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
         }
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+    }
+
+    if (pager->io_ring != NULL) {
+        io_ring_close(pager->io_ring);
+        free(pager->io_ring);
     }
 
     int result = close(pager->file_descriptor);
@@ -605,16 +2967,54 @@ void db_close(Table* table) {
         printf("Error closing db file.\n");
         exit(EXIT_FAILURE);
     }
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
-        }
+    if (pager->frame_arena != NULL) {
+        munmap(pager->frame_arena, pager->frame_arena_size);
     }
+    free(pager->frames);
+    for (uint32_t s = 0; s < pager->num_shards; s++) {
+        PagerShard* shard = &pager->shards[s];
+        free(shard->page_table);
+        free(shard->ghost_table);
+        free(shard->ghost_pages);
+        free(shard->ghost_next);
+        free(shard->node_frames_used);
+        pthread_cond_destroy(&shard->writes_done);
+        pthread_mutex_destroy(&shard->latch);
+    }
+    free(pager->shards);
+    free(pager->cpu_node);
+    pthread_cond_destroy(&pager->writer_wake);
+    pthread_mutex_destroy(&pager->ring_latch);
+    pthread_mutex_destroy(&pager->latch);
     free(pager);
 }
 
+/*
+Record the root page, page count and freelist in the file header.
+The header page is only marked dirty if one of them changed.
+*/
+void write_header(Table* table) {
+    Pager* pager = table->pager;
+    void* header = pin_page(pager, DB_HEADER_PAGE_NUM);
+    if (*header_root_page(header) != table->root_page_num ||
+        *header_num_pages(header) != pager->num_pages ||
+        *header_freelist_head(header) != pager->freelist_head ||
+        *header_freelist_count(header) != pager->freelist_count) {
+        *header_root_page(header) = table->root_page_num;
+        *header_num_pages(header) = pager->num_pages;
+        *header_freelist_head(header) = pager->freelist_head;
+        *header_freelist_count(header) = pager->freelist_count;
+        pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+    }
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
+}
+
+void db_close(Table* table) {
+    write_header(table);
+    pager_close(table->pager);
+    free(table);
+}
+
 InputBuffer* new_input_buffer() {
     InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
     input_buffer->buffer = NULL;
@@ -668,13 +3068,112 @@ PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
     return PREPARE_SUCCESS;
 }
 
+/*
+Parse a whole token as a number that fits a uint32_t. Anything that is
+not entirely digits, or is too large, is a syntax error; negative
+numbers are reported as such so callers can say so.
+*/
+PrepareResult parse_uint32(const char* string, uint32_t* value) {
+    char* end;
+    errno = 0;
+    long number = strtol(string, &end, 10);
+    if (end == string || *end != '\0' || errno == ERANGE || number > UINT32_MAX) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (number < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    *value = number;
+    return PREPARE_SUCCESS;
+}
+
+// "order by id desc", optionally followed by "limit N".
+PrepareResult prepare_select_order(Statement* statement) {
+    char* by = strtok(NULL, " ");
+    char* column = strtok(NULL, " ");
+    char* direction = strtok(NULL, " ");
+    if (by == NULL || strcmp(by, "by") != 0 || column == NULL || strcmp(column, "id") != 0 ||
+        direction == NULL || strcmp(direction, "desc") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    statement->type = STATEMENT_SELECT_DESCENDING;
+    statement->limit = UINT32_MAX;
+    char* limit = strtok(NULL, " ");
+    if (limit == NULL) {
+        return PREPARE_SUCCESS;
+    }
+    char* limit_string = strtok(NULL, " ");
+    if (strcmp(limit, "limit") != 0 || limit_string == NULL || strtok(NULL, " ") != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (parse_uint32(limit_string, &statement->limit) != PREPARE_SUCCESS) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/*
+One of "select", which scans the whole table,
+"select where id = N", which looks up a single row,
+"select where id between A and B", which scans a range of ids, or
+"select order by id desc limit N", which scans backward from the end.
+*/
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+    char* keyword = strtok(input_buffer->buffer, " ");
+    char* where = strtok(NULL, " ");
+    if (strcmp(keyword, "select") != 0) {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    if (where == NULL) {
+        statement->type = STATEMENT_SELECT;
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(where, "order") == 0) {
+        return prepare_select_order(statement);
+    }
+
+    char* column = strtok(NULL, " ");
+    char* operator = strtok(NULL, " ");
+    if (strcmp(where, "where") != 0 || column == NULL || strcmp(column, "id") != 0 ||
+        operator == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (strcmp(operator, "=") == 0) {
+        char* id_string = strtok(NULL, " ");
+        if (id_string == NULL || strtok(NULL, " ") != NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->type = STATEMENT_SELECT_BY_ID;
+        return parse_uint32(id_string, &statement->id_to_select);
+    }
+
+    if (strcmp(operator, "between") == 0) {
+        char* min_string = strtok(NULL, " ");
+        char* and = strtok(NULL, " ");
+        char* max_string = strtok(NULL, " ");
+        if (min_string == NULL || and == NULL || strcmp(and, "and") != 0 ||
+            max_string == NULL || strtok(NULL, " ") != NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->type = STATEMENT_SELECT_RANGE;
+        PrepareResult result = parse_uint32(min_string, &statement->min_id);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+        return parse_uint32(max_string, &statement->max_id);
+    }
+
+    return PREPARE_SYNTAX_ERROR;
+}
+
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
     if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
         return prepare_insert(input_buffer, statement);
     }
     if (strncmp(input_buffer->buffer, "select", 6) == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        return prepare_select(input_buffer, statement);
     }
 
     return PREPARE_UNRECOGNIZED_STATEMENT;
@@ -689,23 +3188,29 @@ enum ExecuteResult_t {
 typedef enum ExecuteResult_t ExecuteResult;
 
 ExecuteResult execute_insert(Statement* statement, Table* table) {
-    void* node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
-
     Row *row_to_insert = &(statement->row_to_insert);
     uint32_t key_to_insert = row_to_insert->id;
     Cursor* cursor = table_find(table, key_to_insert);
 
+    void* node = cursor->node;
+    uint32_t num_cells = (*leaf_node_num_cells(node));
     if (cursor->cell_num < num_cells) {
         uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
         if (key_at_index == key_to_insert) {
+            cursor_close(cursor);
             return EXECUTE_DUPLICATE_KEY;
         }
     }
 
     leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
 
-    free(cursor);
+    cursor_close(cursor);
+    /*
+    A split may have moved the root or added pages. The background writer
+    can write the tree before the database is closed, so the header must
+    change with it.
+    */
+    write_header(table);
 
     return EXIT_SUCCESS;
 }
@@ -719,35 +3224,235 @@ ExecuteResult execute_select(Statement* statement, Table* table) {
         print_row(&row);
         cursor_advance(cursor);
     }
-    free(cursor);
+    cursor_close(cursor);
 
     return EXIT_SUCCESS;
 }
 
+// Descends straight to the key's leaf instead of scanning the table.
+ExecuteResult execute_select_by_id(Statement* statement, Table* table) {
+    uint32_t id = statement->id_to_select;
+    Cursor* cursor = table_find(table, id);
+
+    if (cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+        *leaf_node_key(cursor->node, cursor->cell_num) == id) {
+        Row row;
+        deserialize_row(cursor_value(cursor), &row);
+        print_row(&row);
+    }
+    cursor_close(cursor);
+
+    return EXECUTE_SUCCESS;
+}
+
+/*
+Seek to the first id in the range and walk the leaves until an id
+past its end. Like a full scan, this does not make the leaves it
+reads look hot to the buffer pool.
+*/
+ExecuteResult execute_select_range(Statement* statement, Table* table) {
+    Cursor* cursor = table_seek(table, statement->min_id);
+    cursor->access = PAGE_ACCESS_SCAN;
+
+    Row row;
+    while (!(cursor->end_of_table) && cursor_key(cursor) <= statement->max_id) {
+        deserialize_row(cursor_value(cursor), &row);
+        print_row(&row);
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+
+    return EXECUTE_SUCCESS;
+}
+
+// Only the leaves holding the rows returned are read.
+ExecuteResult execute_select_descending(Statement* statement, Table* table) {
+    Cursor* cursor = table_end(table);
+
+    Row row;
+    for (uint32_t i = 0; i < statement->limit && !(cursor->end_of_table); i++) {
+        deserialize_row(cursor_value(cursor), &row);
+        print_row(&row);
+        cursor_retreat(cursor);
+    }
+    cursor_close(cursor);
+
+    return EXECUTE_SUCCESS;
+}
+
 ExecuteResult execute_statement(Statement* statement, Table* table) {
     switch (statement->type) {
         case (STATEMENT_INSERT):
             return execute_insert(statement, table);
         case (STATEMENT_SELECT):
             return execute_select(statement, table);
+        case (STATEMENT_SELECT_BY_ID):
+            return execute_select_by_id(statement, table);
+        case (STATEMENT_SELECT_RANGE):
+            return execute_select_range(statement, table);
+        case (STATEMENT_SELECT_DESCENDING):
+            return execute_select_descending(statement, table);
+    }
+}
+
+/*
+An existing database keeps the page size it was created with, which
+has to be known before the pager can open it. Returns default_size for
+files that are new. The magic and version are checked here too, so
+that a file that is not a database, or is in an older format, is
+reported as such instead of failing its page checksums.
+*/
+uint32_t db_read_page_size(const char* filename, uint32_t default_size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return default_size;
+    }
+    char header[DB_HEADER_SIZE];
+    ssize_t bytes_read = pread(fd, header, DB_HEADER_SIZE, 0);
+    close(fd);
+    if (bytes_read != DB_HEADER_SIZE) {
+        return default_size;
     }
+    if (memcmp(header + DB_HEADER_MAGIC_OFFSET, DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE) != 0) {
+        printf("File is not a database.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (*header_version(header) != DB_FORMAT_VERSION) {
+        printf("Unsupported database format version %d.\n", *header_version(header));
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t page_size = *header_page_size(header);
+    if (!page_size_is_valid(page_size)) {
+        printf("Unsupported page size %d.\n", page_size);
+        exit(EXIT_FAILURE);
+    }
+    return page_size;
 }
 
-Table* db_open(const char* filename) {
-    Pager* pager = pager_open(filename);
+Table* db_open(const char* filename, PagerConfig* config) {
+    set_page_size(db_read_page_size(filename, config->page_size));
+    Pager* pager = pager_open(filename, config);
 
     Table* table = malloc(sizeof(Table));
     table->pager = pager;
-    table->root_page_num = 0;
+    table->splits = 0;
     if (pager->num_pages == 0) {
-        // New database file. Initialize page 0 as leaf node.
-        void* root_node = get_page(pager, 0);
+        // New database file. Write the header and initialize page 1 as leaf node.
+        void* header = pin_page(pager, DB_HEADER_PAGE_NUM);
+        memcpy(header + DB_HEADER_MAGIC_OFFSET, DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE);
+        *header_version(header) = DB_FORMAT_VERSION;
+        *header_page_size(header) = PAGE_SIZE;
+        pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+        unpin_page(pager, DB_HEADER_PAGE_NUM);
+
+        table->root_page_num = get_unused_page_num(pager);
+        void* root_node = pin_page(pager, table->root_page_num);
         initialize_leaf_node(root_node);
         set_node_root(root_node, true);
+        *node_parent(root_node) = 0;
+        pager_mark_dirty(pager, table->root_page_num);
+        unpin_page(pager, table->root_page_num);
+        write_header(table);
+        return table;
+    }
+
+    void* header = pin_page(pager, DB_HEADER_PAGE_NUM);
+    if (*header_page_size(header) != PAGE_SIZE) {
+        printf("Unsupported page size %d.\n", *header_page_size(header));
+        exit(EXIT_FAILURE);
     }
+    table->root_page_num = *header_root_page(header);
+    pager->num_pages = *header_num_pages(header);
+    pager->freelist_head = *header_freelist_head(header);
+    pager->freelist_count = *header_freelist_count(header);
+    unpin_page(pager, DB_HEADER_PAGE_NUM);
     return table;
 }
 
+// All leaves are at the same depth, so follow the leftmost path down.
+uint32_t btree_height(Table* table) {
+    uint32_t height = 1;
+    uint32_t page_num = table->root_page_num;
+    void* node = pin_page(table->pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t child_num = *internal_node_child(node, 0);
+        unpin_page(table->pager, page_num);
+        page_num = child_num;
+        node = pin_page(table->pager, page_num);
+        height++;
+    }
+    unpin_page(table->pager, page_num);
+    return height;
+}
+
+struct Stat_t {
+    const char* name;
+    uint64_t value;
+};
+typedef struct Stat_t Stat;
+
+/*
+Print the pager and B-tree counters, one "name: value" per line or,
+for tools, as a single JSON object.
+*/
+void print_stats(Table* table, bool json) {
+    Pager* pager = table->pager;
+    pthread_mutex_lock(&pager->latch);
+    PagerStats pager_stats = pager->stats;
+    pthread_mutex_unlock(&pager->latch);
+    uint32_t frames_used = 0;
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_shards; i++) {
+        PagerShard* shard = &pager->shards[i];
+        pthread_mutex_lock(&shard->latch);
+        frames_used += shard->num_frames_used;
+        num_dirty += shard->num_dirty;
+        pager_stats.hits += shard->stats.hits;
+        pager_stats.misses += shard->stats.misses;
+        pager_stats.evictions += shard->stats.evictions;
+        pager_stats.remote_accesses += shard->stats.remote_accesses;
+        pthread_mutex_unlock(&shard->latch);
+    }
+
+    Stat stats[] = {
+        {"cache_frames", pager->mode == PAGER_MODE_MMAP ? 0 : pager->num_frames},
+        {"cache_frames_used", frames_used},
+        {"cache_shards", pager->mode == PAGER_MODE_MMAP ? 0 : pager->num_shards},
+        {"cache_hits", pager_stats.hits},
+        {"cache_misses", pager_stats.misses},
+        {"cache_evictions", pager_stats.evictions},
+        {"numa_nodes", pager->num_nodes},
+        {"numa_remote_accesses", pager_stats.remote_accesses},
+        {"dirty_frames", num_dirty},
+        {"pages_read", pager_stats.pages_read},
+        {"pages_written", pager_stats.pages_written},
+        {"bytes_read", pager_stats.bytes_read},
+        {"bytes_written", pager_stats.bytes_written},
+        {"fsyncs", pager_stats.fsyncs},
+        {"io_time_us", pager_stats.io_time_ns / 1000},
+        {"page_size", PAGE_SIZE},
+        {"num_pages", pager->num_pages},
+        {"btree_height", btree_height(table)},
+        {"btree_splits", table->splits},
+    };
+    uint32_t num_stats = sizeof(stats) / sizeof(stats[0]);
+
+    if (json) {
+        printf("{");
+        for (uint32_t i = 0; i < num_stats; i++) {
+            printf("%s\"%s\": %lu", i == 0 ? "" : ", ", stats[i].name,
+                   (unsigned long)stats[i].value);
+        }
+        printf("}\n");
+    } else {
+        printf("Stats:\n");
+        for (uint32_t i = 0; i < num_stats; i++) {
+            printf("%s: %lu\n", stats[i].name, (unsigned long)stats[i].value);
+        }
+    }
+}
+
 MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
     if (strcmp(input_buffer->buffer, ".exit") == 0) {
         db_close(table);
@@ -758,13 +3463,104 @@ MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
         return META_COMMAND_SUCCESS;
     } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
         printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
+        print_tree(table->pager, table->root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+        print_stats(table, false);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats json") == 0) {
+        print_stats(table, true);
         return META_COMMAND_SUCCESS;
     } else {
         return META_COMMAND_UNRECOGNIZED_COMMAND;
     }
 }
 
+void parse_options(int argc, char* argv[], PagerConfig* config) {
+    config->mode = PAGER_MODE_BUFFERED;
+    config->num_frames = PAGER_DEFAULT_FRAMES;
+    config->use_io_uring = false;
+    config->readahead_pages = PAGER_DEFAULT_READAHEAD_PAGES;
+    config->prealloc_mb = PAGER_DEFAULT_PREALLOC_MB;
+    config->page_size = DEFAULT_PAGE_SIZE;
+    config->warmup = false;
+    config->num_shards = 0;
+    config->numa = true;
+    config->bg_writer = false;
+    config->dirty_ratio = PAGER_DEFAULT_DIRTY_RATIO;
+    config->dirty_age_ms = PAGER_DEFAULT_DIRTY_AGE_MS;
+
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--cache-frames=", 15) == 0) {
+            int num_frames = atoi(argv[i] + 15);
+            if (num_frames <= 0) {
+                printf("Cache size must be a positive number of frames.\n");
+                exit(EXIT_FAILURE);
+            }
+            config->num_frames = num_frames;
+        } else if (strncmp(argv[i], "--shards=", 9) == 0) {
+            int num_shards = atoi(argv[i] + 9);
+            if (num_shards <= 0) {
+                printf("Shard count must be a positive number.\n");
+                exit(EXIT_FAILURE);
+            }
+            config->num_shards = num_shards;
+        } else if (strcmp(argv[i], "--no-numa") == 0) {
+            config->numa = false;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            config->mode = PAGER_MODE_MMAP;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            config->use_io_uring = true;
+        } else if (strncmp(argv[i], "--readahead=", 12) == 0) {
+            int readahead_pages = atoi(argv[i] + 12);
+            if (readahead_pages < 0) {
+                printf("Readahead must not be negative.\n");
+                exit(EXIT_FAILURE);
+            }
+            config->readahead_pages = readahead_pages;
+        } else if (strncmp(argv[i], "--prealloc-mb=", 14) == 0) {
+            int prealloc_mb = atoi(argv[i] + 14);
+            if (prealloc_mb < 0 || prealloc_mb > PAGER_MAX_PREALLOC_MB) {
+                printf("Preallocation must be between 0 and %d MB.\n",
+                       PAGER_MAX_PREALLOC_MB);
+                exit(EXIT_FAILURE);
+            }
+            config->prealloc_mb = prealloc_mb;
+        } else if (strncmp(argv[i], "--page-size=", 12) == 0) {
+            int page_size = atoi(argv[i] + 12);
+            if (page_size <= 0 || !page_size_is_valid(page_size)) {
+                printf("Page size must be a power of two between %d and %d.\n",
+                       MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+                exit(EXIT_FAILURE);
+            }
+            config->page_size = page_size;
+        } else if (strcmp(argv[i], "--warmup") == 0) {
+            config->warmup = true;
+        } else if (strcmp(argv[i], "--bg-writer") == 0) {
+            config->bg_writer = true;
+        } else if (strncmp(argv[i], "--dirty-ratio=", 14) == 0) {
+            int dirty_ratio = atoi(argv[i] + 14);
+            if (dirty_ratio < 0 || dirty_ratio > 100) {
+                printf("Dirty ratio must be between 0 and 100 percent.\n");
+                exit(EXIT_FAILURE);
+            }
+            config->dirty_ratio = dirty_ratio;
+        } else if (strncmp(argv[i], "--dirty-age-ms=", 15) == 0) {
+            int dirty_age_ms = atoi(argv[i] + 15);
+            if (dirty_age_ms < 0) {
+                printf("Dirty age must not be negative.\n");
+                exit(EXIT_FAILURE);
+            }
+            config->dirty_age_ms = dirty_age_ms;
+        } else {
+            printf("Unrecognized option '%s'\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Tests that link against the engine provide their own main.
+#ifndef DB_NO_MAIN
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         printf("Must supply a database filename.\n");
@@ -772,7 +3568,9 @@ int main(int argc, char *argv[]) {
     }
 
     char* filename = argv[1];
-    Table* table = db_open(filename);
+    PagerConfig config;
+    parse_options(argc, argv, &config);
+    Table* table = db_open(filename, &config);
 
     InputBuffer* input_buffer = new_input_buffer();
     while (true) {
@@ -820,4 +3618,4 @@ int main(int argc, char *argv[]) {
         }
     }
 }
-
+#endif
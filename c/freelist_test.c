@@ -0,0 +1,79 @@
+/*
+Test for the freelist. Nothing in the tree frees pages yet, so this
+frees a batch of pages directly, enough to need several trunk pages,
+and checks that after closing and reopening the database every one of
+them is handed out again exactly once before the file grows.
+*/
+#define DB_NO_MAIN
+#include "db.c"
+#include "test_util.h"
+
+#define FREELIST_TEST_PAGES 3000
+
+const char* FREELIST_DB_FILE = "freelist_test.db";
+
+// Take a page the way a node split does and give it some contents.
+uint32_t freelist_test_allocate(Pager* pager) {
+    uint32_t page_num = get_unused_page_num(pager);
+    void* page = pin_page(pager, page_num);
+    initialize_leaf_node(page);
+    pager_mark_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+    return page_num;
+}
+
+int main() {
+    unlink(FREELIST_DB_FILE);
+    PagerConfig config = test_default_config(64);
+    Table* table = db_open(FREELIST_DB_FILE, &config);
+    Pager* pager = table->pager;
+
+    uint32_t* freed = malloc(sizeof(uint32_t) * FREELIST_TEST_PAGES);
+    for (uint32_t i = 0; i < FREELIST_TEST_PAGES; i++) {
+        freed[i] = freelist_test_allocate(pager);
+    }
+    for (uint32_t i = 0; i < FREELIST_TEST_PAGES; i++) {
+        free_page(pager, freed[i]);
+    }
+    uint32_t num_pages = pager->num_pages;
+    bool ok = test_expect(FREELIST_TEST_PAGES > 2 * FREELIST_TRUNK_MAX_ENTRIES,
+                          "Freed pages fit in fewer than three trunks.");
+    ok &= test_expect(pager->freelist_count == FREELIST_TEST_PAGES,
+                      "Freelist count is wrong after freeing.");
+    db_close(table);
+
+    // The freelist must survive in the header.
+    table = db_open(FREELIST_DB_FILE, &config);
+    pager = table->pager;
+    ok &= test_expect(pager->freelist_count == FREELIST_TEST_PAGES,
+                      "Freelist count is wrong after reopening.");
+
+    bool* was_freed = calloc(num_pages, sizeof(bool));
+    bool* reused = calloc(num_pages, sizeof(bool));
+    for (uint32_t i = 0; i < FREELIST_TEST_PAGES; i++) {
+        was_freed[freed[i]] = true;
+    }
+    for (uint32_t i = 0; i < FREELIST_TEST_PAGES; i++) {
+        uint32_t page_num = freelist_test_allocate(pager);
+        if (page_num >= num_pages || !was_freed[page_num] || reused[page_num]) {
+            printf("Page %d handed out but not free.\n", page_num);
+            ok = false;
+            break;
+        }
+        reused[page_num] = true;
+    }
+    ok &= test_expect(pager->num_pages == num_pages,
+                      "File grew while free pages were left.");
+    ok &= test_expect(pager->freelist_count == 0 && pager->freelist_head == 0,
+                      "Freelist is not empty after reusing every page.");
+    ok &= test_expect(get_unused_page_num(pager) == num_pages,
+                      "Empty freelist does not allocate at the end of the file.");
+    db_close(table);
+    unlink(FREELIST_DB_FILE);
+    free(reused);
+    free(was_freed);
+    free(freed);
+
+    printf("freelist: %s\n", ok ? "ok" : "FAILED");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
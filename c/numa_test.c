@@ -0,0 +1,172 @@
+/*
+Test for NUMA placement. The sysfs directory is replaced by a fake
+two node topology in which every cpu belongs to the second node, so
+the thread running the test is always on node 1 whatever the host
+looks like. It also checks the parser for sysfs id lists.
+*/
+#define DB_NO_MAIN
+#define NUMA_SYSFS_DIR "numa_test_sysfs"
+#include "db.c"
+#include "test_util.h"
+
+#include <sys/stat.h>
+
+#define NUMA_TEST_FRAMES 64
+#define NUMA_TEST_PAGES 256
+
+const char* NUMA_DB_FILE = "numa_test.db";
+
+void numa_test_write(const char* path, const char* contents) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Unable to write %s: %d\n", path, errno);
+        exit(EXIT_FAILURE);
+    }
+    fputs(contents, file);
+    fclose(file);
+}
+
+void numa_test_remove_sysfs() {
+    unlink(NUMA_SYSFS_DIR "/online");
+    unlink(NUMA_SYSFS_DIR "/node0/cpulist");
+    unlink(NUMA_SYSFS_DIR "/node1/cpulist");
+    rmdir(NUMA_SYSFS_DIR "/node0");
+    rmdir(NUMA_SYSFS_DIR "/node1");
+    rmdir(NUMA_SYSFS_DIR);
+}
+
+// Parse a list and compare it with the expected ids.
+bool numa_test_id_list(const char* contents, uint32_t max_ids,
+                       const uint32_t* expected, uint32_t num_expected) {
+    numa_test_write(NUMA_SYSFS_DIR "/online", contents);
+    uint32_t ids[16];
+    uint32_t num_ids = read_id_list(NUMA_SYSFS_DIR "/online", ids, max_ids);
+    bool ok = num_ids == num_expected;
+    for (uint32_t i = 0; ok && i < num_ids; i++) {
+        ok = ids[i] == expected[i];
+    }
+    if (!ok) {
+        printf("Wrong ids parsed from \"%s\".\n", contents);
+    }
+    return ok;
+}
+
+bool numa_test_parser() {
+    const uint32_t ranges[] = {0, 1, 2, 3, 8, 10, 11};
+    const uint32_t single[] = {0};
+    bool ok = numa_test_id_list("0-3,8,10-11\n", 16, ranges, 7);
+    ok &= numa_test_id_list("0\n", 16, single, 1);
+    ok &= numa_test_id_list("0-3,8,10-11\n", 5, ranges, 5);
+    ok &= numa_test_id_list("", 16, NULL, 0);
+    uint32_t ids[1];
+    ok &= test_expect(read_id_list(NUMA_SYSFS_DIR "/missing", ids, 1) == 0,
+                      "Missing file does not give an empty list.");
+    return ok;
+}
+
+uint32_t numa_test_frame(Pager* pager, uint32_t page_num) {
+    return page_table_lookup(pager, pager_shard(pager, page_num), page_num);
+}
+
+uint64_t numa_test_remote_accesses(Pager* pager) {
+    uint64_t remote_accesses = 0;
+    for (uint32_t s = 0; s < pager->num_shards; s++) {
+        remote_accesses += pager->shards[s].stats.remote_accesses;
+    }
+    return remote_accesses;
+}
+
+/*
+Pages loaded by a thread on node 1 go to node 1's sub-pools while
+they have room, then fill the rest of the pool rather than evicting,
+and once the pool is full mostly replace node 1's frames.
+*/
+bool numa_test_pool() {
+    numa_test_write(NUMA_SYSFS_DIR "/online", "0-1\n");
+    numa_test_write(NUMA_SYSFS_DIR "/node0/cpulist", "\n");
+    numa_test_write(NUMA_SYSFS_DIR "/node1/cpulist", "0-4095\n");
+
+    unlink(NUMA_DB_FILE);
+    PagerConfig config = test_default_config(NUMA_TEST_FRAMES);
+    Table* table = db_open(NUMA_DB_FILE, &config);
+    Pager* pager = table->pager;
+    bool ok = test_expect(pager->num_nodes == 2 && numa_current_node(pager) == 1,
+                          "Fake topology was not picked up.");
+    if (!ok) {
+        db_close(table);
+        return false;
+    }
+
+    uint32_t local_misses = 0;
+    uint32_t late_misses = 0;
+    for (uint32_t i = 0; i < NUMA_TEST_PAGES; i++) {
+        bool pool_full = pager_frames_used(pager) == pager->num_frames;
+        uint32_t page_num = get_unused_page_num(pager);
+        void* page = pin_page(pager, page_num);
+        initialize_leaf_node(page);
+        pager_mark_dirty(pager, page_num);
+        PagerShard* shard = pager_shard(pager, page_num);
+        bool local = frame_node(pager, numa_test_frame(pager, page_num)) == 1;
+        unpin_page(pager, page_num);
+
+        if (pool_full) {
+            late_misses++;
+            local_misses += local;
+        } else if (!local) {
+            // Node 0's sub-pool is only used once node 1's is full.
+            ok &= test_expect(shard->node_frames_used[1] == pager->frames_per_node,
+                              "Page loaded into a remote sub-pool first.");
+        }
+    }
+    ok &= test_expect(late_misses > 0, "Pool never filled up.");
+    ok &= test_expect(local_misses * 4 >= late_misses * 3,
+                      "Evictions did not prefer local frames.");
+
+    // Only pins of pages left in node 0's frames are remote.
+    uint64_t remote_before = numa_test_remote_accesses(pager);
+    uint32_t remote_pins = 0;
+    for (uint32_t page_num = 0; page_num < pager->num_pages; page_num++) {
+        uint32_t frame_num = numa_test_frame(pager, page_num);
+        if (frame_num != INVALID_FRAME_NUM) {
+            pin_page(pager, page_num);
+            unpin_page(pager, page_num);
+            remote_pins += frame_node(pager, frame_num) != 1;
+        }
+    }
+    ok &= test_expect(numa_test_remote_accesses(pager) - remote_before == remote_pins,
+                      "Remote accesses miscounted.");
+    db_close(table);
+    unlink(NUMA_DB_FILE);
+    return ok;
+}
+
+/*
+Node ids past NUMA_MAX_NODES, as on hosts that number their nodes
+sparsely, do not fit the node masks, so the pool falls back to one node.
+*/
+bool numa_test_sparse_ids() {
+    numa_test_write(NUMA_SYSFS_DIR "/online", "0,252\n");
+    unlink(NUMA_DB_FILE);
+    PagerConfig config = test_default_config(NUMA_TEST_FRAMES);
+    Table* table = db_open(NUMA_DB_FILE, &config);
+    bool ok = test_expect(table->pager->num_nodes == 1,
+                          "Node ids too large for a node mask were used.");
+    db_close(table);
+    unlink(NUMA_DB_FILE);
+    return ok;
+}
+
+int main() {
+    numa_test_remove_sysfs();
+    mkdir(NUMA_SYSFS_DIR, 0755);
+    mkdir(NUMA_SYSFS_DIR "/node0", 0755);
+    mkdir(NUMA_SYSFS_DIR "/node1", 0755);
+
+    bool ok = numa_test_parser();
+    ok &= numa_test_pool();
+    ok &= numa_test_sparse_ids();
+    numa_test_remove_sysfs();
+
+    printf("numa: %s\n", ok ? "ok" : "FAILED");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
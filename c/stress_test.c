@@ -0,0 +1,139 @@
+/*
+Stress test for the buffer pool. Several threads pin, change and unpin
+pages of a file much larger than the pool at the same time, so pages
+are constantly evicted and read back across all shards. Every thread
+owns a slice of the pages and counts how often it changed each one;
+at the end the file must hold exactly those counts.
+*/
+#define DB_NO_MAIN
+#include "db.c"
+#include "test_util.h"
+
+#define STRESS_THREADS 8
+#define STRESS_PAGES 512
+#define STRESS_ITERATIONS 20000
+
+const char* STRESS_DB_FILE = "stress_test.db";
+const uint32_t STRESS_PAGE_NUM_OFFSET = 0;
+const uint32_t STRESS_VERSION_OFFSET = 4;
+
+struct StressThread_t {
+    Pager* pager;
+    uint32_t id;
+    uint32_t versions[STRESS_PAGES];
+    bool failed;
+};
+typedef struct StressThread_t StressThread;
+
+uint32_t* stress_page_num(void* page) {
+    return page + STRESS_PAGE_NUM_OFFSET;
+}
+
+uint32_t* stress_version(void* page) {
+    return page + STRESS_VERSION_OFFSET;
+}
+
+uint32_t stress_random(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/*
+Mostly change one of the thread's own pages, checking that the last
+change survived, and sometimes read a page owned by another thread,
+checking that the pool returned the right page.
+*/
+void* stress_thread_main(void* arg) {
+    StressThread* thread = arg;
+    uint32_t state = thread->id * 2654435761u + 1;
+    for (uint32_t i = 0; i < STRESS_ITERATIONS; i++) {
+        uint32_t page_num = stress_random(&state) % STRESS_PAGES;
+        bool own = page_num % STRESS_THREADS == thread->id;
+        bool scan = stress_random(&state) % 8 == 0;
+        void* page = pager_pin_page(thread->pager, page_num,
+                                    scan ? PAGE_ACCESS_SCAN : PAGE_ACCESS_NORMAL);
+        if (*stress_page_num(page) != page_num) {
+            printf("Thread %d pinned page %d but got page %d\n", thread->id,
+                   page_num, *stress_page_num(page));
+            thread->failed = true;
+        }
+        if (own) {
+            if (*stress_version(page) != thread->versions[page_num]) {
+                printf("Page %d lost a change: version %d, expected %d\n", page_num,
+                       *stress_version(page), thread->versions[page_num]);
+                thread->failed = true;
+            }
+            (*stress_version(page))++;
+            thread->versions[page_num]++;
+            pager_mark_dirty(thread->pager, page_num);
+        }
+        unpin_page(thread->pager, page_num);
+    }
+    return NULL;
+}
+
+bool stress_run(const char* name, PagerConfig* config) {
+    unlink(STRESS_DB_FILE);
+    Pager* pager = pager_open(STRESS_DB_FILE, config);
+    for (uint32_t i = 0; i < STRESS_PAGES; i++) {
+        void* page = pin_page(pager, i);
+        *stress_page_num(page) = i;
+        pager_mark_dirty(pager, i);
+        unpin_page(pager, i);
+    }
+
+    StressThread* threads = calloc(STRESS_THREADS, sizeof(StressThread));
+    pthread_t handles[STRESS_THREADS];
+    for (uint32_t i = 0; i < STRESS_THREADS; i++) {
+        threads[i].pager = pager;
+        threads[i].id = i;
+        pthread_create(&handles[i], NULL, stress_thread_main, &threads[i]);
+    }
+    bool failed = false;
+    for (uint32_t i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(handles[i], NULL);
+        failed |= threads[i].failed;
+    }
+    pager_close(pager);
+
+    // Every change must have reached the file.
+    pager = pager_open(STRESS_DB_FILE, config);
+    for (uint32_t i = 0; i < STRESS_PAGES; i++) {
+        void* page = pin_page(pager, i);
+        uint32_t expected = threads[i % STRESS_THREADS].versions[i];
+        if (*stress_page_num(page) != i || *stress_version(page) != expected) {
+            printf("Page %d on disk is page %d version %d, expected version %d\n", i,
+                   *stress_page_num(page), *stress_version(page), expected);
+            failed = true;
+        }
+        unpin_page(pager, i);
+    }
+    pager_close(pager);
+    unlink(STRESS_DB_FILE);
+    free(threads);
+
+    printf("%s: %s\n", name, failed ? "FAILED" : "ok");
+    return !failed;
+}
+
+int main() {
+    set_page_size(DEFAULT_PAGE_SIZE);
+    PagerConfig config = test_default_config(64);
+    config.num_shards = 4;
+    bool ok = stress_run("sharded pool", &config);
+
+    config.bg_writer = true;
+    config.dirty_age_ms = 0;
+    ok &= stress_run("sharded pool with background writer", &config);
+
+    config.bg_writer = false;
+    config.use_io_uring = true;
+    ok &= stress_run("sharded pool with io_uring readahead", &config);
+
+    config.use_io_uring = false;
+    config.num_shards = 1;
+    ok &= stress_run("single shard", &config);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,24 @@
+/*
+Helpers shared by the test harnesses. Include after db.c, which the
+harnesses build with DB_NO_MAIN.
+*/
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+// The configuration the db program runs with when given no options.
+PagerConfig test_default_config(uint32_t num_frames) {
+    PagerConfig config;
+    parse_options(0, NULL, &config);
+    config.num_frames = num_frames;
+    return config;
+}
+
+// Print the message if the condition does not hold.
+bool test_expect(bool condition, const char* message) {
+    if (!condition) {
+        printf("%s\n", message);
+    }
+    return condition;
+}
+
+#endif
@@ -2,7 +2,13 @@
 
 set -e
 
-gcc -o ./db -Wall -O0 ./c/db.c
+gcc -o ./db -Wall -O0 ./c/db.c -lpthread
+gcc -o ./stress_test -Wall -O0 ./c/stress_test.c -lpthread
+./stress_test
+gcc -o ./freelist_test -Wall -O0 ./c/freelist_test.c -lpthread
+./freelist_test
+gcc -o ./numa_test -Wall -O0 ./c/numa_test.c -lpthread
+./numa_test
 python3.7 -m unittest
 
 cargo build
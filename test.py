@@ -1,14 +1,18 @@
+import json
 import os
+import random
+import struct
 import subprocess
+import time
 import unittest
 
 TARGET = os.getenv("TARGET", "./db")
 TEST_DATABASE_FILE = os.getenv("TEST_DATABASE_FILE", "./test.db")
 
 
-def run_script(commands):
+def run_script(commands, args=()):
     p = subprocess.Popen(
-        [TARGET, TEST_DATABASE_FILE],
+        [TARGET, TEST_DATABASE_FILE, *args],
         stdin=subprocess.PIPE,
         stdout=subprocess.PIPE,
         stderr=subprocess.STDOUT,
@@ -25,12 +29,74 @@ def run_script(commands):
     return p.returncode, lines
 
 
+def start_script(commands, args=()):
+    """Start the database on some commands and leave it running for more."""
+    p = subprocess.Popen(
+        [TARGET, TEST_DATABASE_FILE, *args],
+        stdin=subprocess.PIPE,
+        stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT,
+        universal_newlines=True,
+        encoding='utf-8')
+    p.stdin.write("".join(command + "\n" for command in commands))
+    p.stdin.flush()
+    return p
+
+
+def insert_shuffled(ids, seed):
+    """Insert a row for each id, in an order that is shuffled but repeatable."""
+    ids = list(ids)
+    random.Random(seed).shuffle(ids)
+    ops = [f"insert {i} user{i} person{i}@example.com" for i in ids]
+    ops.append(".exit")
+    return run_script(ops)
+
+
+def strip_prompt(lines):
+    """Remove the prompt from lines that start with it, leaving just the output."""
+    return [line[len("db > "):] if line.startswith("db > ") else line for line in lines]
+
+
+def crc32c(data):
+    crc = 0xffffffff
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82f63b78 if crc & 1 else 0)
+    return crc ^ 0xffffffff
+
+
+def online_numa_nodes():
+    """Count the nodes in sysfs the way the pager does; 1 without NUMA."""
+    try:
+        with open("/sys/devices/system/node/online") as f:
+            ranges = f.read().strip().split(",")
+    except OSError:
+        return 1
+    count = 0
+    for r in ranges:
+        first, _, last = r.partition("-")
+        count += int(last or first) - int(first) + 1
+    return max(count, 1)
+
+
+def rewrite_page(page_num, offset, data, page_size=4096):
+    """Change part of a page and fix up its checksum."""
+    with open(TEST_DATABASE_FILE, "r+b") as f:
+        f.seek(page_num * page_size)
+        page = bytearray(f.read(page_size))
+        page[offset:offset + len(data)] = data
+        page[-4:] = struct.pack("<I", crc32c(page[:-4]))
+        f.seek(page_num * page_size)
+        f.write(page)
+
+
 class MyDatabaseTest(unittest.TestCase):
     maxDiff = None
 
     def tearDown(self):
         try:
-            subprocess.run(["rm", TEST_DATABASE_FILE])
+            subprocess.run(["rm", "-f", TEST_DATABASE_FILE, TEST_DATABASE_FILE + "-warm"])
         except Exception as e:
             print(e)
 
@@ -48,16 +114,21 @@ class MyDatabaseTest(unittest.TestCase):
             "db > ",
         ])
 
-    def test_prints_error_message_when_table_is_full(self):
-        ops = []
-        for i in range(1, 1401):
-            ops.append(f"insert {i} user{i} person{i}@example.com")
-        ops.append(".exit")
-        _, outs = run_script(ops)
-        self.assertEqual(outs[-3:-1], [
-            "db > Executed.",
-            "db > Need to implement updating parent after split",
+    def test_grows_the_tree_past_two_levels(self):
+        code, outs = insert_shuffled(range(1, 6001), 0)
+        self.assertEqual(code, 0)
+        self.assertEqual(outs.count("db > Executed."), 6000)
+
+        _, outs = run_script([
+            ".btree",
+            ".stats json",
+            ".exit",
         ])
+        leaf_keys = [int(line.split()[1]) for line in outs
+                     if line.strip().startswith("- ") and line.split()[1].isdigit()]
+        self.assertListEqual(leaf_keys, list(range(1, 6001)))
+        stats = json.loads(outs[-2][len("db > "):])
+        self.assertEqual(stats["btree_height"], 3)
 
     def test_allows_inserting_strings_that_are_the_maximum_length(self):
         long_username = "a"*32
@@ -123,6 +194,222 @@ class MyDatabaseTest(unittest.TestCase):
             "db > ",
         ])
 
+    def test_keeps_data_after_closing_connection_with_mmap_pager(self):
+        ops = []
+        for i in range(1, 15):
+            ops.append(f"insert {i} user{i} person{i}@example.com")
+        ops.append(".exit")
+        _, outs = run_script(ops, ["--mmap"])
+        self.assertEqual(outs[-2:], [
+            "db > Executed.",
+            "db > ",
+        ])
+        self.assertEqual(os.path.getsize(TEST_DATABASE_FILE), 4 * 4096)
+
+        _, outs = run_script([
+            ".btree",
+            ".exit",
+        ], ["--mmap"])
+        self.assertListEqual(outs[:3], [
+            "db > Tree:",
+            "- internal (size 1)",
+            "  - leaf (size 7)",
+        ])
+
+    def test_keeps_data_after_closing_connection_with_io_uring(self):
+        ops = []
+        for i in range(1, 15):
+            ops.append(f"insert {i} user{i} person{i}@example.com")
+        ops.append(".exit")
+        run_script(ops, ["--io-uring"])
+
+        _, outs = run_script([
+            ".btree",
+            ".exit",
+        ], ["--io-uring"])
+        self.assertListEqual(outs[:3], [
+            "db > Tree:",
+            "- internal (size 1)",
+            "  - leaf (size 7)",
+        ])
+
+    def test_keeps_data_after_closing_connection_with_background_writer(self):
+        ops = []
+        for i in range(1, 15):
+            ops.append(f"insert {i} user{i} person{i}@example.com")
+        p = start_script(ops, ["--bg-writer", "--dirty-ratio=0", "--dirty-age-ms=0"])
+        # Every page is over the dirty limits, so the writer trickles them out
+        # well within a few of its wake-up intervals.
+        time.sleep(0.5)
+        outs, _ = p.communicate(input=".stats json\n.exit\n", timeout=5)
+        stats = json.loads(outs.split("\n")[-2][len("db > "):])
+        self.assertGreater(stats["pages_written"], 0)
+        self.assertGreater(stats["fsyncs"], 0)
+
+        _, outs = run_script([
+            ".btree",
+            ".exit",
+        ])
+        self.assertListEqual(outs[:3], [
+            "db > Tree:",
+            "- internal (size 1)",
+            "  - leaf (size 7)",
+        ])
+
+    def test_background_writer_keeps_the_file_consistent_after_a_crash(self):
+        p = start_script([f"insert {i} user{i} person{i}@example.com" for i in range(1, 201)],
+                         ["--bg-writer", "--dirty-age-ms=0"])
+        # Let the writer catch up, then die without closing the database.
+        time.sleep(0.5)
+        p.kill()
+        p.wait()
+
+        _, outs = run_script([
+            "select where id = 150",
+            "insert 1000 user1000 person1000@example.com",
+            "select order by id desc limit 2",
+            ".stats json",
+            ".exit",
+        ])
+        self.assertListEqual(outs[:6], [
+            "db > (150, user150, person150@example.com)",
+            "Executed.",
+            "db > Executed.",
+            "db > (1000, user1000, person1000@example.com)",
+            "(200, user200, person200@example.com)",
+            "Executed.",
+        ])
+        stats = json.loads(outs[6][len("db > "):])
+        self.assertEqual(stats["btree_height"], 2)
+
+        _, outs = run_script(["select", ".exit"])
+        self.assertListEqual(strip_prompt(outs[:201]), [
+            *[f"({i}, user{i}, person{i}@example.com)" for i in (*range(1, 201), 1000)],
+        ])
+
+    def test_saves_and_reloads_cached_pages_with_warmup(self):
+        run_script([
+            "insert 1 user1 person1@example.com",
+            "insert 2 user2 person2@example.com",
+            ".exit",
+        ], ["--warmup"])
+
+        with open(TEST_DATABASE_FILE + "-warm") as f:
+            self.assertListEqual(sorted(f.read().split()), ["0", "1"])
+
+        _, outs = run_script([
+            "select",
+            ".exit",
+        ], ["--warmup"])
+        self.assertListEqual(outs, [
+            "db > (1, user1, person1@example.com)",
+            "(2, user2, person2@example.com)",
+            "Executed.",
+            "db > ",
+        ])
+
+    def test_warmup_loads_the_saved_pages_before_they_are_used(self):
+        ops = [f"insert {i} user{i} person{i}@example.com" for i in range(1, 501)]
+        ops.append(".exit")
+        run_script(ops, ["--warmup"])
+        with open(TEST_DATABASE_FILE + "-warm") as f:
+            num_warm_pages = len(f.read().split())
+        self.assertGreater(num_warm_pages, 30)
+
+        # No statement touches the tree before the stats are taken.
+        p = start_script([], ["--warmup"])
+        time.sleep(0.5)
+        outs, _ = p.communicate(input=".stats json\n.exit\n", timeout=5)
+        stats = json.loads(outs.split("\n")[0][len("db > "):])
+        self.assertEqual(stats["pages_read"], num_warm_pages)
+        self.assertEqual(stats["cache_frames_used"], num_warm_pages)
+
+    def test_prints_an_error_message_if_file_is_not_a_database(self):
+        with open(TEST_DATABASE_FILE, "wb") as f:
+            f.write(b"x" * 4096)
+        code, outs = run_script([".exit"])
+        self.assertEqual(code, 1)
+        self.assertListEqual(outs, [
+            "File is not a database.",
+            "",
+        ])
+
+    def test_releases_preallocated_space_on_close(self):
+        for prealloc_mb in [1, 64]:
+            run_script([
+                "insert 1 user1 person1@example.com",
+                ".exit",
+            ], [f"--prealloc-mb={prealloc_mb}"])
+            st = os.stat(TEST_DATABASE_FILE)
+            self.assertEqual(st.st_size, 2 * 4096)
+            self.assertLessEqual(st.st_blocks * 512, st.st_size)
+            os.remove(TEST_DATABASE_FILE)
+
+    def test_prints_an_error_message_if_format_version_is_old(self):
+        run_script([
+            "insert 1 user1 person1@example.com",
+            ".exit",
+        ])
+        rewrite_page(0, 16, struct.pack("<I", 4))
+        code, outs = run_script([".exit"])
+        self.assertEqual(code, 1)
+        self.assertListEqual(outs, [
+            "Unsupported database format version 4.",
+            "",
+        ])
+
+    def test_detects_a_corrupt_page_on_read(self):
+        run_script([
+            "insert 1 user1 person1@example.com",
+            ".exit",
+        ])
+        with open(TEST_DATABASE_FILE, "r+b") as f:
+            f.seek(4096 + 20)
+            f.write(b"X")
+        code, outs = run_script([
+            "select",
+            ".exit",
+        ])
+        self.assertEqual(code, 1)
+        self.assertListEqual(outs, [
+            "db > Page 1 is corrupt: checksum mismatch.",
+            "",
+        ])
+
+    def test_writes_pages_beyond_4_gigabytes(self):
+        run_script([
+            "insert 1 user1 person1@example.com",
+            ".exit",
+        ])
+        # Grow the file to 5 GB as a sparse file and tell the header
+        # about it, so every newly allocated page lies past 4 GB.
+        num_pages = 5 * 1024 * 1024 * 1024 // 4096
+        os.truncate(TEST_DATABASE_FILE, num_pages * 4096)
+        rewrite_page(0, 28, struct.pack("<I", num_pages))
+
+        ops = []
+        for i in range(2, 15):
+            ops.append(f"insert {i} user{i} person{i}@example.com")
+        ops.append(".exit")
+        run_script(ops)
+        self.assertEqual(os.path.getsize(TEST_DATABASE_FILE), (num_pages + 2) * 4096)
+
+        _, outs = run_script([
+            ".btree",
+            ".exit",
+        ])
+        self.assertListEqual(outs[:4], [
+            "db > Tree:",
+            "- internal (size 1)",
+            "  - leaf (size 7)",
+            "    - 1",
+        ])
+        self.assertListEqual(outs[10:13], [
+            "- key 7",
+            "  - leaf (size 7)",
+            "    - 8",
+        ])
+
     def test_print_constants(self):
         _, outs = run_script([
             ".constants",
@@ -132,13 +419,96 @@ class MyDatabaseTest(unittest.TestCase):
             "db > Constants:",
             "ROW_SIZE: 293",
             "COMMON_NODE_HEADER_SIZE: 6",
-            "LEAF_NODE_HEADER_SIZE: 10",
+            "LEAF_NODE_HEADER_SIZE: 18",
             "LEAF_NODE_CELL_SIZE: 297",
-            "LEAF_NODE_SPACE_FOR_CELLS: 4086",
+            "LEAF_NODE_SPACE_FOR_CELLS: 4074",
             "LEAF_NODE_MAX_CELLS: 13",
             "db > ",
         ])
 
+    def test_uses_the_page_size_the_database_was_created_with(self):
+        ops = []
+        for i in range(1, 31):
+            ops.append(f"insert {i} user{i} person{i}@example.com")
+        ops.append(".exit")
+        run_script(ops, ["--page-size=16384"])
+
+        _, outs = run_script([
+            ".constants",
+            ".btree",
+            ".exit",
+        ])
+        self.assertEqual(os.path.getsize(TEST_DATABASE_FILE), 2 * 16384)
+        self.assertListEqual(outs[5:9], [
+            "LEAF_NODE_SPACE_FOR_CELLS: 16362",
+            "LEAF_NODE_MAX_CELLS: 55",
+            "db > Tree:",
+            "- leaf (size 30)",
+        ])
+
+    def test_prints_buffer_pool_and_btree_stats(self):
+        ops = []
+        for i in range(1, 15):
+            ops.append(f"insert {i} user{i} person{i}@example.com")
+        ops.append(".stats")
+        ops.append(".exit")
+        _, outs = run_script(ops)
+        self.assertIn("db > Stats:", outs)
+        self.assertIn("btree_height: 2", outs)
+        self.assertIn("btree_splits: 1", outs)
+
+        _, outs = run_script([
+            ".stats json",
+            ".exit",
+        ])
+        stats = json.loads(outs[0][len("db > "):])
+        self.assertEqual(stats["cache_misses"], 1)
+        self.assertEqual(stats["pages_read"], 1)
+        self.assertEqual(stats["bytes_read"], 4096)
+        self.assertEqual(stats["num_pages"], 4)
+        self.assertEqual(stats["btree_height"], 2)
+        self.assertEqual(stats["btree_splits"], 0)
+        self.assertEqual(stats["numa_nodes"], online_numa_nodes())
+
+        _, outs = run_script([
+            ".stats json",
+            ".exit",
+        ], ["--no-numa"])
+        stats = json.loads(outs[0][len("db > "):])
+        self.assertEqual(stats["numa_nodes"], 1)
+
+    def test_full_scan_does_not_evict_hot_pages(self):
+        ops = [f"insert {i} user{i} person{i}@example.com" for i in range(1, 3001)]
+        ops.append(".exit")
+        run_script(ops)
+
+        lookups = [f"select where id = {i}" for i in range(1, 3001, 75)]
+        for frames in (200, 400, 1000):
+            with self.subTest(frames=frames):
+                _, outs = run_script(
+                    lookups * 3 + ["select", ".stats json"] + lookups + [".stats json", ".exit"],
+                    [f"--cache-frames={frames}"])
+                stats = [json.loads(line[len("db > "):]) for line in outs
+                         if line.startswith("db > {")]
+                self.assertEqual(stats[1]["cache_misses"], stats[0]["cache_misses"])
+
+    def test_runs_with_a_cache_smaller_than_one_shard(self):
+        code, outs = run_script([
+            "insert 1 user1 person1@example.com",
+            "select",
+            ".stats json",
+            ".exit",
+        ], ["--cache-frames=5"])
+        self.assertEqual(code, 0)
+        self.assertListEqual(outs[:3], [
+            "db > Executed.",
+            "db > (1, user1, person1@example.com)",
+            "Executed.",
+        ])
+        stats = json.loads(outs[3][len("db > "):])
+        self.assertEqual(stats["cache_shards"], 1)
+        self.assertEqual(stats["cache_frames"], 16)
+
     def test_allow_printing_out_the_structure_of_a_one_node_btree(self):
         ops = []
         for i in [3, 1, 2]:
@@ -205,6 +575,129 @@ class MyDatabaseTest(unittest.TestCase):
             "db > ",
         ])
 
+    def test_prints_all_rows_in_a_multi_level_tree(self):
+        ops = []
+        for i in range(1, 16):
+            ops.append(f"insert {i} user{i} person{i}@example.com")
+        ops.append("select")
+        ops.append(".exit")
+        _, outs = run_script(ops)
+        self.assertListEqual(outs[15:], [
+            "db > (1, user1, person1@example.com)",
+            *[f"({i}, user{i}, person{i}@example.com)" for i in range(2, 16)],
+            "Executed.",
+            "db > ",
+        ])
+
+    def test_scans_thousands_of_rows_across_leaves(self):
+        insert_shuffled(range(1, 3001), 1)
+
+        _, outs = run_script(["select", ".exit"], ["--cache-frames=32"])
+        rows = strip_prompt(outs[:3000])
+        self.assertListEqual(rows, [
+            f"({i}, user{i}, person{i}@example.com)" for i in range(1, 3001)
+        ])
+
+    def test_selects_a_single_row_by_id(self):
+        insert_shuffled(range(1, 3001), 2)
+
+        _, outs = run_script([
+            "select where id = 1234",
+            "select where id = 5000",
+            "select where id = -1",
+            "select where username = 1",
+            "select where id = 5x",
+            "select where id = abc",
+            "select where id = 4294967301",
+            ".stats json",
+            ".exit",
+        ])
+        self.assertListEqual(outs[:8], [
+            "db > (1234, user1234, person1234@example.com)",
+            "Executed.",
+            "db > Executed.",
+            "db > ID must be positive.",
+            "db > Syntax error. Could not parse statement.",
+            "db > Syntax error. Could not parse statement.",
+            "db > Syntax error. Could not parse statement.",
+            "db > Syntax error. Could not parse statement.",
+        ])
+        # The header page and one page per level of the tree.
+        stats = json.loads(outs[8][len("db > "):])
+        self.assertEqual(stats["pages_read"], 4)
+
+    def test_selects_a_range_of_ids(self):
+        insert_shuffled(range(2, 6001, 2), 3)
+
+        _, outs = run_script([
+            "select where id between 1001 and 4000",
+            ".exit",
+        ])
+        rows = strip_prompt(outs[:1501])
+        self.assertListEqual(rows, [
+            *[f"({i}, user{i}, person{i}@example.com)" for i in range(1002, 4001, 2)],
+            "Executed.",
+        ])
+
+        _, outs = run_script([
+            "select where id between 5995 and 9999",
+            "select where id between 20 and 10",
+            "select where id between 5",
+            "select where id between a and 9",
+            "select where id between 1 and 9x",
+            "select where id between -1 and 9",
+            "select where id between 5999 and 3000000000",
+            ".exit",
+        ])
+        self.assertListEqual(outs, [
+            "db > (5996, user5996, person5996@example.com)",
+            "(5998, user5998, person5998@example.com)",
+            "(6000, user6000, person6000@example.com)",
+            "Executed.",
+            "db > Executed.",
+            "db > Syntax error. Could not parse statement.",
+            "db > Syntax error. Could not parse statement.",
+            "db > Syntax error. Could not parse statement.",
+            "db > ID must be positive.",
+            "db > (6000, user6000, person6000@example.com)",
+            "Executed.",
+            "db > ",
+        ])
+
+    def test_selects_the_latest_ids_in_descending_order(self):
+        insert_shuffled(range(1, 3001), 4)
+
+        _, outs = run_script([
+            "select order by id desc limit 3",
+            "select order by id asc",
+            "select order by id desc limit abc",
+            "select order by id desc limit 5x",
+            "select order by id desc limit -1",
+            "select order by id desc limit 99999999999",
+            ".stats json",
+            ".exit",
+        ])
+        self.assertListEqual(outs[:9], [
+            "db > (3000, user3000, person3000@example.com)",
+            "(2999, user2999, person2999@example.com)",
+            "(2998, user2998, person2998@example.com)",
+            "Executed.",
+            "db > Syntax error. Could not parse statement.",
+            "db > Syntax error. Could not parse statement.",
+            "db > Syntax error. Could not parse statement.",
+            "db > Syntax error. Could not parse statement.",
+            "db > Syntax error. Could not parse statement.",
+        ])
+        # The header page, the root and the rightmost leaf.
+        stats = json.loads(outs[9][len("db > "):])
+        self.assertEqual(stats["pages_read"], 3)
+
+        _, outs = run_script(["select order by id desc", ".exit"], ["--cache-frames=32"])
+        rows = strip_prompt(outs[:3000])
+        self.assertListEqual(rows, [
+            f"({i}, user{i}, person{i}@example.com)" for i in range(3000, 0, -1)
+        ])
+
 
 if __name__ == '__main__':
     unittest.main()